@@ -35,19 +35,25 @@ void printerror(int err, int y, int x);
 //File descriptor for Bluetooth Communication
 int tty_fd;
 
+//Largest scan reply the rover sends: a reported object spans at least 4 degrees, so there
+//are at most 45 in 180, each record no longer than o45u9999r999x-1799y1799d999s179e179q,
+//followed by n<samples>z
+#define MAX_OBJECTS 45
+#define REPLY_SIZE (MAX_OBJECTS * 40 + 16)
+
 //Detected Objects struct
 struct object {
 	int distance;
 	int start_angle;
 	int end_angle;
 };
-struct object object_detected[15];
+struct object object_detected[MAX_OBJECTS];
 //Master count of objects
 int objectcount = 0;
 
 //Command history
 struct command {
-	char value[100];
+	char value[REPLY_SIZE];
 };
 struct command history[1000];
 int history_index = 0;
@@ -69,11 +75,8 @@ int main(int argc, char *argv[]){
 	char str[80];
 	char snd[80];
 	char msg[80];
-	char rcv[80];
-	int m;
-	for (m=0;m<80;m++){
-		rcv[m] = '\0';
-	}
+	char rcv[REPLY_SIZE];
+	memset(rcv, 0, sizeof(rcv));
 	
 	int h;
 	int angle;
@@ -191,10 +194,7 @@ int main(int argc, char *argv[]){
     		move(10,0);
     		
     		//Reset the rcv string
-			int m;
-			for (m=0;m<80;m++){
-				rcv[m] = '\0';
-			}
+			memset(rcv, 0, sizeof(rcv));
     		
     		//Send the message to scan
     		write(tty_fd,msg,3);
@@ -220,9 +220,12 @@ int main(int argc, char *argv[]){
     					}
     				}
     				//If byte has been read, write to rcv, advance rcv index, and break out of the loop
+    				//(bytes past a full rcv are dropped, keeping it terminated)
     				else if (bytesread > 0){
-    					rcv[i] = c;
-    					i++;
+    					if (i < sizeof(rcv) - 1){
+    						rcv[i] = c;
+    						i++;
+    					}
     					done =1;
     				}
     			}
@@ -248,34 +251,43 @@ int main(int argc, char *argv[]){
    	 				case 's':
    	 					//Last set of numbers were distance value, in a string of chars (used chars instead of actual values so display would be human readable)
    	 					//Write to object detected struct the integer value of the distance
-						object_detected[objectcount].distance=atoi(intstring);
+						if (objectcount < MAX_OBJECTS){
+							object_detected[objectcount].distance=atoi(intstring);
+						}
 						//Reset intstring
    	 					memcpy(intstring,empty,5);
 						l = 0;
    	 					break;
    	 				case 'e':
    	 					//Last set of numbers were angle start value, write to struct and reset intstring
-   	 					object_detected[objectcount].start_angle=atoi(intstring);
+   	 					if (objectcount < MAX_OBJECTS){
+   	 						object_detected[objectcount].start_angle=atoi(intstring);
+   	 					}
    	 					memcpy(intstring,empty,5);
    	 					l = 0;
    	 					break;
    	 				case 'q':
    	 					//End of object, write end angle to struct, reset intstring, advance object count
-   	 					object_detected[objectcount].end_angle=atoi(intstring);
+   	 					if (objectcount < MAX_OBJECTS){
+   	 						object_detected[objectcount].end_angle=atoi(intstring);
+   	 						objectcount++;
+   	 					}
    	 					memcpy(intstring,empty,5);
    	 					l = 0;
-   	 					objectcount++;
    	 					break;
    	 				default:
    	 					//If not a letter, assuming a number has been transmitted, write to intstring for later conversion to actual integer
-   	 					intstring[l] = rcv[j];
-   	 					l++;
+   	 					//Other letters (u spread, n samples) are skipped, and a number never outgrows intstring
+   	 					if (rcv[j] >= '0' && rcv[j] <= '9' && l < 4){
+   	 						intstring[l] = rcv[j];
+   	 						l++;
+   	 					}
    	 			}
    	 			
    	 		}
    	 		//Write the string received to history, so printscan can use past scans to re-print
    	 		history_index++;
-   	 		strcpy(history[history_index].value,rcv);
+   	 		snprintf(history[history_index].value, sizeof(history[history_index].value), "%s", rcv);
    	 		//Draw the polar grid
    	 		drawgrid();
    	 		//Draw all of the objects
@@ -342,28 +354,37 @@ int main(int argc, char *argv[]){
    		 				case 's':
    	 						//Last set of numbers were distance value, in a string of chars (used chars instead of actual values so display would be human readable)
    	 						//Write to object detected struct the integer value of the distance
-							object_detected[objectcount].distance=atoi(intstring);
+							if (objectcount < MAX_OBJECTS){
+								object_detected[objectcount].distance=atoi(intstring);
+							}
 							//Reset intstring
    	 						memcpy(intstring,empty,5);
 							l = 0;
    	 						break;
    	 					case 'e':
    	 						//Last set of numbers were angle start value, write to struct and reset intstring
-   	 						object_detected[objectcount].start_angle=atoi(intstring);
+   	 						if (objectcount < MAX_OBJECTS){
+   	 							object_detected[objectcount].start_angle=atoi(intstring);
+   	 						}
    	 						memcpy(intstring,empty,5);
    	 						l = 0;
    	 						break;
    	 					case 'q':
    	 						//End of object, write end angle to struct, reset intstring, advance object count
-   	 						object_detected[objectcount].end_angle=atoi(intstring);
+   	 						if (objectcount < MAX_OBJECTS){
+   	 							object_detected[objectcount].end_angle=atoi(intstring);
+   	 							objectcount++;
+   	 						}
    	 						memcpy(intstring,empty,5);
    	 						l = 0;
-   	 						objectcount++;
    	 						break;
    	 					default:
    	 						//If not a letter, assuming a number has been transmitted, write to intstring for later conversion to actual integer
-   	 						intstring[l] = rcv[j];
-   	 						l++;
+   	 						//Other letters (u spread, n samples) are skipped, and a number never outgrows intstring
+   	 						if (rcv[j] >= '0' && rcv[j] <= '9' && l < 4){
+   	 							intstring[l] = rcv[j];
+   	 							l++;
+   	 						}
    	 				}	
    	 			}
    	 			//Draw the polar grid
@@ -880,8 +901,14 @@ int init_serial(char *argv){
 	return 0;
 }
 
+///Order objects by start angle, for qsort
+static int compareobjects(const void *a, const void *b){
+	return ((const struct object *)a)->start_angle - ((const struct object *)b)->start_angle;
+}
+
 ///Draw detected objects to screen
 /* Uses the detected object global struct
+* Sorts the objects by start angle first, since the rover sends them in the order its sweep met them, which alternates between scans
 * Passes through all objects, takes their distance, start and end angles, and converts them to pixel locations to print to screen
 * Also prints the numerical details (including calculated size) in line form to the screen
 */
@@ -912,6 +939,8 @@ void drawobjects(void){
 	attron(A_BLINK);
 	addch('$');
 	
+	//Lowest angle first, whichever way the sweep went
+	qsort(object_detected, objectcount, sizeof(object_detected[0]), compareobjects);
 	//Cycle through the objects in the object struct
 	for (i=0;i<objectcount;i++){
 		//Calculate the center angle from the start and end angles
@@ -0,0 +1,28 @@
+/**
+ * hal.h: hardware abstraction for the rover firmware
+ *
+ * The firmware drives the ATmega128 through its I/O registers and ISRs.  On the AVR
+ * (make avr) those come straight from avr-libc.  The Linux build (make host) puts host/
+ * ahead of the system headers, so <avr/io.h> and <avr/interrupt.h> resolve to an
+ * emulated register file on a virtual 16 MHz clock instead; see host/sim.h.
+ *
+ * Loops that wait on a variable set from an interrupt call hal_idle() on every pass,
+ * which is what lets the emulated clock move on to the next peripheral event.
+ */
+
+#ifndef HAL_H
+#define HAL_H
+
+#ifdef HAL_HOST
+
+/// Wait for the next interrupt; advances the virtual clock to the next peripheral event
+void hal_idle(void);
+
+#else
+
+/// Wait for the next interrupt; nothing to do on the AVR, the ISR preempts the loop
+#define hal_idle() do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,21 @@
+/**
+ * avr/interrupt.h (host): interrupt control for the emulated ATmega128
+ *
+ * ISR(vector) defines a plain function; the simulator calls it when the matching
+ * peripheral flag is raised, its enable bit is set and the global I flag is set.
+ */
+
+#ifndef HOST_AVR_INTERRUPT_H
+#define HOST_AVR_INTERRUPT_H
+
+#include <avr/io.h>
+
+void sim_sei(void);
+void sim_cli(void);
+
+#define sei() sim_sei()
+#define cli() sim_cli()
+
+#define ISR(vector) void vector(void)
+
+#endif
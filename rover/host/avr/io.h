@@ -0,0 +1,232 @@
+/**
+ * avr/io.h (host): emulated ATmega128 I/O registers
+ *
+ * Stands in for the avr-libc header when the firmware is built for Linux (make host).
+ * Every register name expands to an access through the simulator (sim_core.c), which
+ * advances the virtual clock, runs due peripheral events and interrupts, and then hands
+ * back the register cell.  A write is picked up on the next register access, so the
+ * firmware keeps its usual read-modify-write style (PORTA |= 0x40).
+ *
+ * The data registers UDR0/UDR1 are 16 bit cells: the simulator parks 0x01 in the high
+ * byte before handing one out.  A stored char leaves 0x00 or 0xFF there (sign extended),
+ * so a write is recognised even when the same byte is sent twice.
+ */
+
+#ifndef HOST_AVR_IO_H
+#define HOST_AVR_IO_H
+
+#include <stdint.h>
+
+#ifndef F_CPU
+#define F_CPU 16000000UL
+#endif
+
+/// Register ids of the emulated register file
+enum sim_sfr {
+	SFR_PINA, SFR_DDRA, SFR_PORTA,
+	SFR_PINB, SFR_DDRB, SFR_PORTB,
+	SFR_PINC, SFR_DDRC, SFR_PORTC,
+	SFR_PIND, SFR_DDRD, SFR_PORTD,
+	SFR_PINE, SFR_DDRE, SFR_PORTE,
+	SFR_SREG, SFR_MCUCR,
+	SFR_TIMSK, SFR_TIFR, SFR_ETIMSK, SFR_ETIFR,
+	SFR_TCCR2, SFR_TCNT2, SFR_OCR2,
+	SFR_TCCR1A, SFR_TCCR1B, SFR_TCCR1C, SFR_TCNT1, SFR_ICR1, SFR_OCR1A, SFR_OCR1B,
+	SFR_TCCR3A, SFR_TCCR3B, SFR_TCCR3C, SFR_TCNT3, SFR_OCR3A, SFR_OCR3B, SFR_OCR3C,
+	SFR_UBRR0H, SFR_UBRR0L, SFR_UCSR0A, SFR_UCSR0B, SFR_UCSR0C, SFR_UDR0,
+	SFR_UBRR1H, SFR_UBRR1L, SFR_UCSR1A, SFR_UCSR1B, SFR_UCSR1C, SFR_UDR1,
+	SFR_ADMUX, SFR_ADCSRA, SFR_ADC,
+	SFR_COUNT
+};
+
+volatile uint8_t *sim_sfr8(int id);
+volatile uint16_t *sim_sfr16(int id);
+
+#define _SFR_HOST8(id)  (*sim_sfr8(id))
+#define _SFR_HOST16(id) (*sim_sfr16(id))
+
+#define _BV(bit) (1 << (bit))
+
+// Ports
+#define PINA   _SFR_HOST8(SFR_PINA)
+#define DDRA   _SFR_HOST8(SFR_DDRA)
+#define PORTA  _SFR_HOST8(SFR_PORTA)
+#define PINB   _SFR_HOST8(SFR_PINB)
+#define DDRB   _SFR_HOST8(SFR_DDRB)
+#define PORTB  _SFR_HOST8(SFR_PORTB)
+#define PINC   _SFR_HOST8(SFR_PINC)
+#define DDRC   _SFR_HOST8(SFR_DDRC)
+#define PORTC  _SFR_HOST8(SFR_PORTC)
+#define PIND   _SFR_HOST8(SFR_PIND)
+#define DDRD   _SFR_HOST8(SFR_DDRD)
+#define PORTD  _SFR_HOST8(SFR_PORTD)
+#define PINE   _SFR_HOST8(SFR_PINE)
+#define DDRE   _SFR_HOST8(SFR_DDRE)
+#define PORTE  _SFR_HOST8(SFR_PORTE)
+
+#define SREG   _SFR_HOST8(SFR_SREG)
+#define MCUCR  _SFR_HOST8(SFR_MCUCR)
+
+// Timer interrupt masks and flags
+#define TIMSK  _SFR_HOST8(SFR_TIMSK)
+#define TIFR   _SFR_HOST8(SFR_TIFR)
+#define ETIMSK _SFR_HOST8(SFR_ETIMSK)
+#define ETIFR  _SFR_HOST8(SFR_ETIFR)
+
+#define OCIE2  7
+#define TOIE2  6
+#define TICIE1 5
+#define OCIE1A 4
+#define OCIE1B 3
+#define TOIE1  2
+#define OCIE0  1
+#define TOIE0  0
+
+#define OCF2   7
+#define TOV2   6
+#define ICF1   5
+#define OCF1A  4
+#define OCF1B  3
+#define TOV1   2
+#define OCF0   1
+#define TOV0   0
+
+// Timer 2
+#define TCCR2  _SFR_HOST8(SFR_TCCR2)
+#define TCNT2  _SFR_HOST8(SFR_TCNT2)
+#define OCR2   _SFR_HOST8(SFR_OCR2)
+
+#define FOC2   7
+#define WGM20  6
+#define COM21  5
+#define COM20  4
+#define WGM21  3
+#define CS22   2
+#define CS21   1
+#define CS20   0
+
+// Timer 1
+#define TCCR1A _SFR_HOST8(SFR_TCCR1A)
+#define TCCR1B _SFR_HOST8(SFR_TCCR1B)
+#define TCCR1C _SFR_HOST8(SFR_TCCR1C)
+#define TCNT1  _SFR_HOST16(SFR_TCNT1)
+#define ICR1   _SFR_HOST16(SFR_ICR1)
+#define OCR1A  _SFR_HOST16(SFR_OCR1A)
+#define OCR1B  _SFR_HOST16(SFR_OCR1B)
+
+#define ICNC1  7
+#define ICES1  6
+#define ICES   ICES1
+#define WGM13  4
+#define WGM12  3
+#define CS12   2
+#define CS11   1
+#define CS10   0
+
+// Timer 3
+#define TCCR3A _SFR_HOST8(SFR_TCCR3A)
+#define TCCR3B _SFR_HOST8(SFR_TCCR3B)
+#define TCCR3C _SFR_HOST8(SFR_TCCR3C)
+#define TCNT3  _SFR_HOST16(SFR_TCNT3)
+#define OCR3A  _SFR_HOST16(SFR_OCR3A)
+#define OCR3B  _SFR_HOST16(SFR_OCR3B)
+#define OCR3C  _SFR_HOST16(SFR_OCR3C)
+
+// USART0 and USART1
+#define UBRR0H _SFR_HOST8(SFR_UBRR0H)
+#define UBRR0L _SFR_HOST8(SFR_UBRR0L)
+#define UCSR0A _SFR_HOST8(SFR_UCSR0A)
+#define UCSR0B _SFR_HOST8(SFR_UCSR0B)
+#define UCSR0C _SFR_HOST8(SFR_UCSR0C)
+#define UDR0   _SFR_HOST16(SFR_UDR0)
+#define UBRR1H _SFR_HOST8(SFR_UBRR1H)
+#define UBRR1L _SFR_HOST8(SFR_UBRR1L)
+#define UCSR1A _SFR_HOST8(SFR_UCSR1A)
+#define UCSR1B _SFR_HOST8(SFR_UCSR1B)
+#define UCSR1C _SFR_HOST8(SFR_UCSR1C)
+#define UDR1   _SFR_HOST16(SFR_UDR1)
+
+#define RXC    7
+#define TXC    6
+#define UDRE   5
+#define FE     4
+#define DOR    3
+#define UPE    2
+#define U2X    1
+#define MPCM   0
+#define RXC0   RXC
+#define TXC0   TXC
+#define UDRE0  UDRE
+#define DOR0   DOR
+#define U2X0   U2X
+#define RXC1   RXC
+#define TXC1   TXC
+#define UDRE1  UDRE
+#define DOR1   DOR
+#define U2X1   U2X
+
+#define RXCIE  7
+#define TXCIE  6
+#define UDRIE  5
+#define RXEN   4
+#define TXEN   3
+#define UCSZ2  2
+#define RXCIE0 RXCIE
+#define TXCIE0 TXCIE
+#define UDRIE0 UDRIE
+#define RXEN0  RXEN
+#define TXEN0  TXEN
+#define RXCIE1 RXCIE
+#define TXCIE1 TXCIE
+#define UDRIE1 UDRIE
+#define RXEN1  RXEN
+#define TXEN1  TXEN
+
+#define USBS   3
+#define USBS0  USBS
+#define USBS1  USBS
+#define UCSZ00 1
+#define UCSZ01 2
+#define UCSZ10 1
+#define UCSZ11 2
+
+// ADC
+#define ADMUX  _SFR_HOST8(SFR_ADMUX)
+#define ADCSRA _SFR_HOST8(SFR_ADCSRA)
+#define ADC    _SFR_HOST16(SFR_ADC)
+#define ADCW   ADC
+
+#define REFS1  7
+#define REFS0  6
+#define ADLAR  5
+#define MUX4   4
+#define MUX3   3
+#define MUX2   2
+#define MUX1   1
+#define MUX0   0
+
+#define ADEN   7
+#define ADSC   6
+#define ADFR   5
+#define ADIF   4
+#define ADIE   3
+#define ADPS2  2
+#define ADPS1  1
+#define ADPS0  0
+
+// Interrupt vectors, named after the ISR functions the simulator dispatches to
+#define TIMER2_COMP_vect   sim_vect_TIMER2_COMP
+#define TIMER2_OVF_vect    sim_vect_TIMER2_OVF
+#define TIMER1_CAPT_vect   sim_vect_TIMER1_CAPT
+#define TIMER1_COMPA_vect  sim_vect_TIMER1_COMPA
+#define TIMER1_OVF_vect    sim_vect_TIMER1_OVF
+#define USART0_RX_vect     sim_vect_USART0_RX
+#define USART0_UDRE_vect   sim_vect_USART0_UDRE
+#define USART0_TX_vect     sim_vect_USART0_TX
+#define ADC_vect           sim_vect_ADC
+#define TIMER3_COMPA_vect  sim_vect_TIMER3_COMPA
+#define USART1_RX_vect     sim_vect_USART1_RX
+#define USART1_UDRE_vect   sim_vect_USART1_UDRE
+#define USART1_TX_vect     sim_vect_USART1_TX
+
+#endif
@@ -0,0 +1,27 @@
+/**
+ * avr/pgmspace.h (host): program memory access for the emulated ATmega128
+ *
+ * The host has one address space, so PROGMEM data is ordinary const data and the
+ * pgm_read_ functions are plain loads.
+ */
+
+#ifndef HOST_AVR_PGMSPACE_H
+#define HOST_AVR_PGMSPACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define PGM_P const char *
+
+#define pgm_read_byte(address) (*(const uint8_t *) (address))
+#define pgm_read_word(address) (*(const uint16_t *) (address))
+
+#define sprintf_P sprintf
+#define strlen_P strlen
+#define memcpy_P memcpy
+#define vsnprintf_P vsnprintf
+
+#endif
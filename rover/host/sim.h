@@ -0,0 +1,129 @@
+/**
+ * sim.h: internals of the Linux backend of the rover HAL
+ *
+ * The host build links the unmodified firmware against an emulated ATmega128.  Time is a
+ * virtual 16 MHz cycle counter (sim_now) that only moves when the firmware touches a
+ * register, idles in hal_idle(), or polls the same status register in a loop; in the last
+ * two cases the clock jumps straight to the next scheduled peripheral event, so waits
+ * cost no host time and a run finishes much faster than real time.
+ *
+ * Peripherals (sim_timer.c, sim_usart.c, sim_adc.c, sim_world.c, sim_lcd.c) keep their
+ * own state, publish it through the register image and raise interrupt flags there.  The
+ * two serial peers are a model of the iRobot Create (sim_create.c) on USART1 and a
+ * scripted pilot (sim_pilot.c) on USART0.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <avr/io.h>
+
+#define SIM_CYCLES_PER_MS (F_CPU / 1000)
+#define SIM_CYCLES_PER_US (F_CPU / 1000000)
+
+/// Virtual clock in CPU cycles since reset
+extern uint64_t sim_now;
+
+/// Register image; peripherals keep it in step with their state
+extern uint16_t sim_reg[SFR_COUNT];
+
+/// Interrupt sources, in ATmega128 priority order
+enum sim_vector {
+	SIM_VEC_TIMER2_COMP,
+	SIM_VEC_TIMER2_OVF,
+	SIM_VEC_TIMER1_CAPT,
+	SIM_VEC_TIMER1_COMPA,
+	SIM_VEC_TIMER1_OVF,
+	SIM_VEC_USART0_RX,
+	SIM_VEC_USART0_UDRE,
+	SIM_VEC_USART0_TX,
+	SIM_VEC_ADC,
+	SIM_VEC_TIMER3_COMPA,
+	SIM_VEC_USART1_RX,
+	SIM_VEC_USART1_UDRE,
+	SIM_VEC_USART1_TX,
+	SIM_VEC_COUNT
+};
+
+typedef void (*sim_event_fn)(int arg);
+
+// sim_core.c
+
+/// Run fn(arg) once the virtual clock reaches when
+void sim_schedule(uint64_t when, sim_event_fn fn, int arg);
+
+/// Drop a scheduled fn(arg), if any
+void sim_cancel(sim_event_fn fn, int arg);
+
+/// Print a line to stderr, stamped with the virtual time, when ROVER_SIM_TRACE is set
+void sim_trace(const char *format, ...);
+
+/// Print the run summary and leave the program
+void sim_finish(const char *why);
+
+/// Virtual time in milliseconds
+double sim_ms(void);
+
+// Peripheral hooks called by sim_core.c; old is the image before the write
+
+void sim_timer_reset(void);
+void sim_timer_write(int id, uint16_t old);
+void sim_timer_read(int id);
+void sim_timer1_capture(int level);
+uint64_t sim_timer_poll(int id);
+
+void sim_usart_reset(void);
+void sim_usart_write(int id, uint16_t old);
+void sim_usart_read(int id);
+void sim_usart_commit_read(int id);
+
+void sim_adc_reset(void);
+void sim_adc_write(int id, uint16_t old);
+
+void sim_world_reset(void);
+void sim_world_write(int id, uint16_t old);
+void sim_world_read(int id);
+
+void sim_lcd_write(uint8_t old, uint8_t value);
+
+// sim_usart.c
+
+/// Queue a byte from a peer towards the MCU on USART unit (0 or 1)
+void sim_usart_send(int unit, uint8_t data);
+
+/// Cycles one frame takes on the line at the current UBRR setting
+uint64_t sim_usart_frame_cycles(int unit);
+
+// sim_world.c
+
+/// Load an arena description; see sim_world.c for the format
+void sim_world_load(const char *path);
+
+/// Current servo angle in degrees, following the servo's slew
+double sim_servo_angle(void);
+
+/// ADC reading of the IR sensor at the current servo angle
+uint16_t sim_world_ir_adc(void);
+
+/// Rover pose in the arena (cm, degrees), moved by the Create model
+void sim_world_move(double distance_mm, double angle_deg);
+
+/// Bump and cliff state of the rover at its current pose
+void sim_world_contacts(uint8_t *bumps, uint16_t cliff_signal[4]);
+
+// Serial peers
+
+void sim_create_reset(void);
+void sim_create_receive(uint8_t data);
+
+void sim_pilot_reset(void);
+void sim_pilot_receive(uint8_t data);
+
+/// The rover has enabled its USART0 receiver
+void sim_pilot_start(void);
+
+/// The last queued pilot byte has reached the MCU
+void sim_pilot_drained(void);
+
+#endif
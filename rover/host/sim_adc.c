@@ -0,0 +1,83 @@
+/**
+ * sim_adc.c: emulated ADC
+ *
+ * A conversion takes 13 ADC clocks (25 for the first one after ADEN is set) and samples
+ * the channel selected by MUX4:0 when it completes.  Channel 2 is the IR sensor; the
+ * other inputs read as ground.  Free running mode (ADFR) starts the next conversion on
+ * the channel selected at that moment.
+ */
+
+#include <avr/io.h>
+#include "sim.h"
+
+#define IR_CHANNEL 2
+
+static int converting;
+static int first;
+
+static const unsigned adc_prescalers[8] = { 2, 2, 4, 8, 16, 32, 64, 128 };
+
+static void adc_done(int arg);
+
+static void adc_start(void) {
+	unsigned clocks = first ? 25 : 13;
+
+	first = 0;
+	converting = 1;
+	sim_reg[SFR_ADCSRA] |= _BV(ADSC);
+	sim_schedule(sim_now + (uint64_t) clocks * adc_prescalers[sim_reg[SFR_ADCSRA] & 0x07], adc_done, 0);
+}
+
+static void adc_done(int arg) {
+	uint16_t value = 0;
+
+	(void) arg;
+	if ((sim_reg[SFR_ADMUX] & 0x1F) == IR_CHANNEL)
+		value = sim_world_ir_adc();
+	if (sim_reg[SFR_ADMUX] & _BV(ADLAR))
+		value <<= 6;
+	sim_reg[SFR_ADC] = value;
+	sim_reg[SFR_ADCSRA] |= _BV(ADIF);
+
+	converting = 0;
+	if (sim_reg[SFR_ADCSRA] & _BV(ADFR))
+		adc_start();
+	else
+		sim_reg[SFR_ADCSRA] &= ~_BV(ADSC);
+}
+
+void sim_adc_reset(void) {
+	converting = 0;
+	first = 1;
+}
+
+void sim_adc_write(int id, uint16_t old) {
+	uint16_t value = sim_reg[id];
+	int start = (value & _BV(ADSC)) && !converting;
+
+	if (id == SFR_ADC) {
+		// Result registers are read only
+		sim_reg[id] = old;
+		return;
+	}
+	if (id != SFR_ADCSRA)
+		return;
+
+	// ADIF is cleared by writing a one; ADSC only by the hardware
+	if (value & _BV(ADIF))
+		value &= ~_BV(ADIF);
+	else
+		value |= old & _BV(ADIF);
+	value = (value & ~_BV(ADSC)) | (converting ? _BV(ADSC) : 0);
+	sim_reg[id] = value;
+
+	if (!(value & _BV(ADEN))) {
+		if (converting)
+			sim_cancel(adc_done, 0);
+		converting = 0;
+		first = 1;
+		sim_reg[id] &= ~_BV(ADSC);
+	} else if (start) {
+		adc_start();
+	}
+}
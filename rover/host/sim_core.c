@@ -0,0 +1,353 @@
+/**
+ * sim_core.c: virtual clock, register file and interrupt dispatch of the Linux backend
+ *
+ * Every register access from the firmware lands in sim_access().  It first hands the
+ * previous access to the peripheral that owns the register (a changed cell is a write),
+ * charges the access to the virtual clock, runs due events and interrupts, and then
+ * returns the requested cell, refreshed if the peripheral computes it on the fly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "sim.h"
+#include "../hal.h"
+
+// Cost of one register access and of entering and leaving an ISR, in cycles
+#define SIM_ACCESS_CYCLES 2
+#define SIM_ISR_CYCLES    8
+
+// Consecutive reads of one register after which the loop counts as a busy-wait
+#define SIM_POLL_LIMIT 16
+
+#define SIM_MAX_EVENTS 64
+
+uint64_t sim_now;
+uint16_t sim_reg[SFR_COUNT];
+
+static struct sim_event {
+	uint64_t when;
+	sim_event_fn fn;
+	int arg;
+} events[SIM_MAX_EVENTS];
+static int event_count;
+
+static int pending_id = -1;		// register handed out by the last access
+static uint16_t pending_old;	// its image at that time
+static int last_write;			// whether the last committed access was a write
+static int poll_id = -1;
+static int poll_count;
+static int in_isr;
+
+static int trace;
+static struct timespec host_start;
+static unsigned long irq_count[SIM_VEC_COUNT];
+static uint64_t irq_cycles[SIM_VEC_COUNT];
+
+// ISRs the firmware may define; unresolved ones stay NULL
+void sim_vect_TIMER2_COMP(void) __attribute__((weak));
+void sim_vect_TIMER2_OVF(void) __attribute__((weak));
+void sim_vect_TIMER1_CAPT(void) __attribute__((weak));
+void sim_vect_TIMER1_COMPA(void) __attribute__((weak));
+void sim_vect_TIMER1_OVF(void) __attribute__((weak));
+void sim_vect_USART0_RX(void) __attribute__((weak));
+void sim_vect_USART0_UDRE(void) __attribute__((weak));
+void sim_vect_USART0_TX(void) __attribute__((weak));
+void sim_vect_ADC(void) __attribute__((weak));
+void sim_vect_TIMER3_COMPA(void) __attribute__((weak));
+void sim_vect_USART1_RX(void) __attribute__((weak));
+void sim_vect_USART1_UDRE(void) __attribute__((weak));
+void sim_vect_USART1_TX(void) __attribute__((weak));
+
+/// Flag and enable bit of each interrupt source; clear means the flag is reset on entry
+static const struct sim_irq {
+	const char *name;
+	uint8_t flag_reg, flag_bit;
+	uint8_t enable_reg, enable_bit;
+	uint8_t clear;
+	void (*handler)(void);
+} irqs[SIM_VEC_COUNT] = {
+	[SIM_VEC_TIMER2_COMP]  = { "TIMER2_COMP",  SFR_TIFR,   OCF2,  SFR_TIMSK,  OCIE2,  1, sim_vect_TIMER2_COMP },
+	[SIM_VEC_TIMER2_OVF]   = { "TIMER2_OVF",   SFR_TIFR,   TOV2,  SFR_TIMSK,  TOIE2,  1, sim_vect_TIMER2_OVF },
+	[SIM_VEC_TIMER1_CAPT]  = { "TIMER1_CAPT",  SFR_TIFR,   ICF1,  SFR_TIMSK,  TICIE1, 1, sim_vect_TIMER1_CAPT },
+	[SIM_VEC_TIMER1_COMPA] = { "TIMER1_COMPA", SFR_TIFR,   OCF1A, SFR_TIMSK,  OCIE1A, 1, sim_vect_TIMER1_COMPA },
+	[SIM_VEC_TIMER1_OVF]   = { "TIMER1_OVF",   SFR_TIFR,   TOV1,  SFR_TIMSK,  TOIE1,  1, sim_vect_TIMER1_OVF },
+	[SIM_VEC_USART0_RX]    = { "USART0_RX",    SFR_UCSR0A, RXC,   SFR_UCSR0B, RXCIE,  0, sim_vect_USART0_RX },
+	[SIM_VEC_USART0_UDRE]  = { "USART0_UDRE",  SFR_UCSR0A, UDRE,  SFR_UCSR0B, UDRIE,  0, sim_vect_USART0_UDRE },
+	[SIM_VEC_USART0_TX]    = { "USART0_TX",    SFR_UCSR0A, TXC,   SFR_UCSR0B, TXCIE,  1, sim_vect_USART0_TX },
+	[SIM_VEC_ADC]          = { "ADC",          SFR_ADCSRA, ADIF,  SFR_ADCSRA, ADIE,   1, sim_vect_ADC },
+	[SIM_VEC_TIMER3_COMPA] = { "TIMER3_COMPA", SFR_ETIFR,  4,     SFR_ETIMSK, 4,      1, sim_vect_TIMER3_COMPA },
+	[SIM_VEC_USART1_RX]    = { "USART1_RX",    SFR_UCSR1A, RXC,   SFR_UCSR1B, RXCIE,  0, sim_vect_USART1_RX },
+	[SIM_VEC_USART1_UDRE]  = { "USART1_UDRE",  SFR_UCSR1A, UDRE,  SFR_UCSR1B, UDRIE,  0, sim_vect_USART1_UDRE },
+	[SIM_VEC_USART1_TX]    = { "USART1_TX",    SFR_UCSR1A, TXC,   SFR_UCSR1B, TXCIE,  1, sim_vect_USART1_TX },
+};
+
+
+
+/// Run fn(arg) once the virtual clock reaches when
+void sim_schedule(uint64_t when, sim_event_fn fn, int arg) {
+	int i;
+
+	if (event_count == SIM_MAX_EVENTS)
+		sim_finish("event queue overflow");
+
+	// Keep the queue sorted; equal times run in the order they were scheduled
+	for (i = event_count; i > 0 && events[i - 1].when > when; i--)
+		events[i] = events[i - 1];
+	events[i].when = when;
+	events[i].fn = fn;
+	events[i].arg = arg;
+	event_count++;
+}
+
+/// Drop a scheduled fn(arg), if any
+void sim_cancel(sim_event_fn fn, int arg) {
+	int i, j = 0;
+
+	for (i = 0; i < event_count; i++) {
+		if (events[i].fn != fn || events[i].arg != arg)
+			events[j++] = events[i];
+	}
+	event_count = j;
+}
+
+double sim_ms(void) {
+	return (double) sim_now / SIM_CYCLES_PER_MS;
+}
+
+void sim_trace(const char *format, ...) {
+	va_list arglist;
+
+	if (!trace)
+		return;
+	fprintf(stderr, "[%12.3f ms] ", sim_ms());
+	va_start(arglist, format);
+	vfprintf(stderr, format, arglist);
+	va_end(arglist);
+	fputc('\n', stderr);
+}
+
+/// Print the run summary and leave the program
+void sim_finish(const char *why) {
+	struct timespec host_end;
+	double host_s;
+	int v;
+
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &host_end);
+	host_s = (host_end.tv_sec - host_start.tv_sec) + (host_end.tv_nsec - host_start.tv_nsec) / 1e9;
+
+	fprintf(stderr, "sim: %s after %.3f ms virtual, %.3f s host (%.0fx real time)\n",
+	        why, sim_ms(), host_s, host_s > 0 ? sim_ms() / 1000 / host_s : 0);
+	if (trace) {
+		for (v = 0; v < SIM_VEC_COUNT; v++) {
+			if (irq_count[v])
+				fprintf(stderr, "sim: %-13s %8lu interrupts %10.3f ms\n",
+				        irqs[v].name, irq_count[v], (double) irq_cycles[v] / SIM_CYCLES_PER_MS);
+		}
+	}
+	exit(0);
+}
+
+
+
+/// Hand a finished access to the peripheral owning the register
+static void commit(void) {
+	int id = pending_id;
+	uint16_t value;
+
+	if (id < 0)
+		return;
+	pending_id = -1;
+	value = sim_reg[id];
+
+	// The data registers are handed out with 0x01 in the high byte; anything else is a write
+	if (id == SFR_UDR0 || id == SFR_UDR1) {
+		last_write = (value >> 8) != 0x01;
+		if (last_write)
+			sim_usart_write(id, pending_old);
+		else
+			sim_usart_commit_read(id);
+		return;
+	}
+
+	last_write = (value != pending_old);
+	if (!last_write)
+		return;
+
+	switch (id) {
+		case SFR_TCCR2: case SFR_TCNT2: case SFR_OCR2: case SFR_TIFR:
+		case SFR_TCCR1A: case SFR_TCCR1B: case SFR_TCNT1: case SFR_OCR1A:
+			sim_timer_write(id, pending_old);
+			break;
+		case SFR_UBRR0H: case SFR_UBRR0L: case SFR_UCSR0A: case SFR_UCSR0B: case SFR_UCSR0C:
+		case SFR_UBRR1H: case SFR_UBRR1L: case SFR_UCSR1A: case SFR_UCSR1B: case SFR_UCSR1C:
+			sim_usart_write(id, pending_old);
+			break;
+		case SFR_ADMUX: case SFR_ADCSRA: case SFR_ADC:
+			sim_adc_write(id, pending_old);
+			break;
+		case SFR_PORTD: case SFR_DDRD: case SFR_OCR3B: case SFR_TCCR3B:
+			sim_world_write(id, pending_old);
+			break;
+		case SFR_PORTA:
+			sim_lcd_write(pending_old, value);
+			break;
+		case SFR_PINA: case SFR_PINB: case SFR_PINC: case SFR_PIND: case SFR_PINE:
+			// Input registers are read only on the ATmega128
+			sim_reg[id] = pending_old;
+			break;
+		default:
+			break;
+	}
+}
+
+/// Run due events, then any enabled interrupt while the I flag is set
+static void service(void) {
+	struct sim_event event;
+	int v;
+
+	for (;;) {
+		while (event_count && events[0].when <= sim_now) {
+			event = events[0];
+			memmove(events, events + 1, --event_count * sizeof(events[0]));
+			event.fn(event.arg);
+		}
+
+		if (in_isr || !(sim_reg[SFR_SREG] & 0x80))
+			return;
+
+		for (v = 0; v < SIM_VEC_COUNT; v++) {
+			const struct sim_irq *irq = &irqs[v];
+			if ((sim_reg[irq->flag_reg] & _BV(irq->flag_bit)) && (sim_reg[irq->enable_reg] & _BV(irq->enable_bit)))
+				break;
+		}
+		if (v == SIM_VEC_COUNT)
+			return;
+
+		if (!irqs[v].handler) {
+			fprintf(stderr, "sim: %s enabled without an ISR\n", irqs[v].name);
+			sim_finish("bad interrupt");
+		}
+
+		uint64_t start = sim_now;
+		if (irqs[v].clear)
+			sim_reg[irqs[v].flag_reg] &= ~_BV(irqs[v].flag_bit);
+		in_isr = 1;
+		sim_reg[SFR_SREG] &= ~0x80;
+		sim_now += SIM_ISR_CYCLES;
+		irqs[v].handler();
+		commit();
+		sim_reg[SFR_SREG] |= 0x80;
+		in_isr = 0;
+		irq_count[v]++;
+		irq_cycles[v] += sim_now - start;
+	}
+}
+
+/// Move the clock to the next scheduled event and service it
+static void skip(void) {
+	if (!event_count)
+		sim_finish("idle with nothing left to happen");
+	if (events[0].when > sim_now)
+		sim_now = events[0].when;
+	service();
+}
+
+/// Refresh registers whose value is computed when read
+static void prepare(int id) {
+	switch (id) {
+		case SFR_TCNT2: case SFR_TCNT1:
+			sim_timer_read(id);
+			break;
+		case SFR_UDR0: case SFR_UDR1:
+			sim_usart_read(id);
+			break;
+		case SFR_PINA: case SFR_PINB: case SFR_PINC: case SFR_PINE:
+			// Inputs float high through the pull-ups; outputs read back what is driven
+			sim_reg[id] = sim_reg[id + 2] | (uint8_t) ~sim_reg[id + 1];
+			break;
+		case SFR_PIND: case SFR_TCNT3:
+			sim_world_read(id);
+			break;
+		default:
+			break;
+	}
+}
+
+static uint16_t *sim_access(int id) {
+	commit();
+	sim_now += SIM_ACCESS_CYCLES;
+	service();
+
+	// A loop re-reading one status register cannot see anything new before the next event;
+	// one re-reading a running counter sees it change at the next timer tick
+	if (id == poll_id && !last_write) {
+		if (++poll_count >= SIM_POLL_LIMIT) {
+			uint64_t tick = sim_timer_poll(id);
+			if (tick) {
+				sim_now += tick;
+				service();
+			} else {
+				skip();
+			}
+		}
+	} else {
+		poll_id = id;
+		poll_count = 0;
+	}
+
+	prepare(id);
+	pending_id = id;
+	pending_old = sim_reg[id];
+	return &sim_reg[id];
+}
+
+volatile uint8_t *sim_sfr8(int id) {
+	return (volatile uint8_t *) sim_access(id);
+}
+
+volatile uint16_t *sim_sfr16(int id) {
+	return (volatile uint16_t *) sim_access(id);
+}
+
+void sim_sei(void) {
+	commit();
+	sim_reg[SFR_SREG] |= 0x80;
+	service();
+}
+
+void sim_cli(void) {
+	commit();
+	sim_reg[SFR_SREG] &= ~0x80;
+}
+
+void hal_idle(void) {
+	commit();
+	poll_id = -1;
+	skip();
+}
+
+
+
+/// Reset the emulated part before the firmware's main() runs
+__attribute__((constructor)) static void sim_start(void) {
+	const char *scene = getenv("ROVER_SIM_SCENE");
+
+	trace = getenv("ROVER_SIM_TRACE") != NULL;
+	clock_gettime(CLOCK_MONOTONIC, &host_start);
+
+	memset(sim_reg, 0, sizeof(sim_reg));
+	sim_timer_reset();
+	sim_usart_reset();
+	sim_adc_reset();
+	sim_world_reset();
+	if (scene)
+		sim_world_load(scene);
+	sim_create_reset();
+	sim_pilot_reset();
+}
@@ -0,0 +1,235 @@
+/**
+ * sim_create.c: iRobot Create on USART1, speaking the Open Interface
+ *
+ * Parses the command stream byte by byte, drives the rover pose in sim_world.c from the
+ * wheel velocities, and answers sensor requests (142 Sensors, 149 Query List, 148 Stream
+ * with 150 Pause/Resume) with packets 7-42 and groups 0-6.  Distance (19) and angle (20)
+ * count from the previous read of that packet, as on the robot.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "sim.h"
+#include "../open_interface.h"
+
+#define AXLE_MM 258.0
+#define STREAM_PERIOD_MS 15
+
+static uint8_t cmd[64];
+static int cmd_len, cmd_need;
+
+static int16_t velocity_right, velocity_left, velocity, radius;
+static uint64_t last_integrate;
+static double distance_mm, angle_deg;	// since last read of packets 19 and 20
+static uint8_t mode;
+static uint8_t song_number;
+
+static uint8_t stream_ids[32];
+static int stream_count, stream_on;
+
+static void stream_event(int arg);
+
+/// Fold wheel travel since the last call into the pose and the odometry counters
+static void integrate(void) {
+	double dt = (double) (sim_now - last_integrate) / F_CPU;
+	double d = (velocity_right + velocity_left) / 2.0 * dt;
+	double a = (velocity_right - velocity_left) / AXLE_MM * dt * 180 / 3.14159265358979;
+
+	last_integrate = sim_now;
+	if (d == 0 && a == 0)
+		return;
+	distance_mm += d;
+	angle_deg += a;
+	sim_world_move(d, a);
+}
+
+/// Size of a sensor packet; groups 0-6 included
+static int packet_size(uint8_t id) {
+	static const uint8_t group_size[7] = { 26, 10, 6, 10, 14, 12, 52 };
+
+	if (id <= 6)
+		return group_size[id];
+	if (id == 19 || id == 20 || id == 22 || id == 23 || (id >= 25 && id <= 31) || id == 33 || id >= 39)
+		return 2;
+	return 1;
+}
+
+static int put16(uint8_t *out, int value) {
+	out[0] = (value >> 8) & 0xFF;
+	out[1] = value & 0xFF;
+	return 2;
+}
+
+/// Encode one packet (or group) big endian into out, returning its length
+static int encode(uint8_t id, uint8_t *out) {
+	static const uint8_t group_first[7] = { 7, 7, 17, 21, 27, 35, 7 };
+	static const uint8_t group_last[7]  = { 26, 16, 20, 26, 34, 42, 42 };
+	uint16_t cliff[4];
+	uint8_t bumps;
+	int value, n = 0, i;
+
+	if (id <= 6) {
+		for (i = group_first[id]; i <= group_last[id]; i++)
+			n += encode(i, out + n);
+		return n;
+	}
+
+	sim_world_contacts(&bumps, cliff);
+	switch (id) {
+		case 7:  out[0] = bumps; return 1;
+		case 17: out[0] = 255; return 1;
+		case 19:
+			integrate();
+			value = (int) distance_mm;
+			distance_mm -= value;
+			return put16(out, value);
+		case 20:
+			integrate();
+			value = (int) angle_deg;
+			angle_deg -= value;
+			return put16(out, value);
+		case 22: return put16(out, 15500);
+		case 23: return put16(out, -450);
+		case 24: out[0] = 27; return 1;
+		case 25: return put16(out, 2300);
+		case 26: return put16(out, 2700);
+		case 28: return put16(out, cliff[0]);
+		case 29: return put16(out, cliff[1]);
+		case 30: return put16(out, cliff[2]);
+		case 31: return put16(out, cliff[3]);
+		case 35: out[0] = mode; return 1;
+		case 36: out[0] = song_number; return 1;
+		case 38: out[0] = stream_count; return 1;
+		case 39: return put16(out, velocity);
+		case 40: return put16(out, radius);
+		case 41: return put16(out, velocity_right);
+		case 42: return put16(out, velocity_left);
+		default:
+			memset(out, 0, packet_size(id));
+			return packet_size(id);
+	}
+}
+
+static void reply(const uint8_t *data, int n) {
+	int i;
+
+	for (i = 0; i < n; i++)
+		sim_usart_send(1, data[i]);
+}
+
+/// One stream frame: 19, length, id and data for each packet, checksum
+static void stream_event(int arg) {
+	uint8_t frame[256];
+	int n = 2, i, sum = 0;
+
+	(void) arg;
+	if (!stream_on)
+		return;
+	frame[0] = 19;
+	for (i = 0; i < stream_count; i++) {
+		frame[n++] = stream_ids[i];
+		n += encode(stream_ids[i], frame + n);
+	}
+	frame[1] = n - 2;
+	for (i = 0; i < n; i++)
+		sum += frame[i];
+	frame[n++] = (uint8_t) -sum;
+	reply(frame, n);
+	sim_schedule(sim_now + STREAM_PERIOD_MS * SIM_CYCLES_PER_MS, stream_event, 0);
+}
+
+/// Number of data bytes following an opcode, given what has arrived so far
+static int command_length(void) {
+	switch (cmd[0]) {
+		case OI_OPCODE_BAUD: case OI_OPCODE_MAX: case OI_OPCODE_PLAY:
+		case OI_OPCODE_SENSORS: case OI_OPCODE_OUTPUTS: case OI_OPCODE_DO_STREAM:
+		case OI_OPCODE_SEND_IR_CHAR: case OI_OPCODE_PLAY_SCRIPT: case OI_OPCODE_WAIT_TIME:
+		case OI_OPCODE_WAIT_EVENT:
+			return 2;
+		case OI_OPCODE_LEDS: case OI_OPCODE_PWM_MOTORS:
+			return 4;
+		case OI_OPCODE_DRIVE: case OI_OPCODE_DRIVE_WHEELS:
+			return 5;
+		case OI_OPCODE_WAIT_DISTANCE: case OI_OPCODE_WAIT_ANGLE:
+			return 3;
+		case OI_OPCODE_SONG:
+			return cmd_len < 3 ? 3 : 3 + 2 * cmd[2];
+		case OI_OPCODE_STREAM: case OI_OPCODE_QUERY_LIST: case OI_OPCODE_SCRIPT:
+			return cmd_len < 2 ? 2 : 2 + cmd[1];
+		default:
+			return 1;
+	}
+}
+
+static void execute(void) {
+	uint8_t out[256];
+	int n = 0, i;
+
+	switch (cmd[0]) {
+		case OI_OPCODE_START: mode = 1; break;
+		case OI_OPCODE_SAFE: case OI_OPCODE_CONTROL: mode = 2; break;
+		case OI_OPCODE_FULL: mode = 3; break;
+		case OI_OPCODE_DRIVE_WHEELS:
+			integrate();
+			velocity_right = (cmd[1] << 8) | cmd[2];
+			velocity_left = (cmd[3] << 8) | cmd[4];
+			sim_trace("create: wheels %d %d", velocity_right, velocity_left);
+			break;
+		case OI_OPCODE_DRIVE:
+			integrate();
+			velocity = (cmd[1] << 8) | cmd[2];
+			radius = (cmd[3] << 8) | cmd[4];
+			if (radius == -1 || radius == 1) {
+				velocity_right = radius * velocity;
+				velocity_left = -radius * velocity;
+			} else {
+				velocity_right = velocity_left = velocity;
+			}
+			break;
+		case OI_OPCODE_PLAY:
+			song_number = cmd[1];
+			sim_trace("create: play song %d", cmd[1]);
+			break;
+		case OI_OPCODE_SENSORS:
+			reply(out, encode(cmd[1], out));
+			break;
+		case OI_OPCODE_QUERY_LIST:
+			for (i = 0; i < cmd[1]; i++)
+				n += encode(cmd[2 + i], out + n);
+			reply(out, n);
+			break;
+		case OI_OPCODE_STREAM:
+			stream_count = cmd[1] < sizeof(stream_ids) ? cmd[1] : sizeof(stream_ids);
+			memcpy(stream_ids, cmd + 2, stream_count);
+			stream_on = 1;
+			sim_cancel(stream_event, 0);
+			sim_schedule(sim_now + STREAM_PERIOD_MS * SIM_CYCLES_PER_MS, stream_event, 0);
+			break;
+		case OI_OPCODE_DO_STREAM:
+			stream_on = cmd[1] && stream_count;
+			sim_cancel(stream_event, 0);
+			if (stream_on)
+				sim_schedule(sim_now + STREAM_PERIOD_MS * SIM_CYCLES_PER_MS, stream_event, 0);
+			break;
+		default:
+			break;
+	}
+}
+
+void sim_create_reset(void) {
+	cmd_len = cmd_need = 0;
+	mode = 0;
+}
+
+void sim_create_receive(uint8_t data) {
+	if (cmd_len == 0 && data < OI_OPCODE_START)
+		return;		// not an opcode; the robot skips it
+	if (cmd_len < (int) sizeof(cmd))
+		cmd[cmd_len] = data;
+	cmd_len++;
+	cmd_need = command_length();
+	if (cmd_len >= cmd_need) {
+		execute();
+		cmd_len = 0;
+	}
+}
@@ -0,0 +1,77 @@
+/**
+ * sim_lcd.c: HD44780 on PORTA, as wired in lcd.c
+ *
+ * PA0-PA3 carry a nibble, PA4 is register select and PA6 enable; the controller latches
+ * on the falling edge of enable.  The first four nibbles are the 8 bit mode wake-up
+ * sequence, after that nibbles pair up high first.  The screen is traced whenever it is
+ * cleared and once more when the run ends, so ROVER_SIM_TRACE shows every lprintf().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sim.h"
+
+#define LCD_ENABLE 0x40
+#define LCD_RS     0x10
+
+static char ddram[0x68];
+static uint8_t address;
+static int nibbles;
+static uint8_t high;
+
+static void lcd_show(void) {
+	static const uint8_t lines[4] = { 0x00, 0x40, 0x14, 0x54 };
+	char text[4 * 23 + 1], *p = text;
+	int i, j, used = 0;
+
+	for (i = 0; i < 4; i++) {
+		*p++ = '|';
+		for (j = 0; j < 20; j++) {
+			char c = ddram[lines[i] + j];
+			*p++ = c ? c : ' ';
+			used |= c;
+		}
+	}
+	*p++ = '|';
+	*p = 0;
+	if (used)
+		sim_trace("lcd: %s", text);
+}
+
+static void lcd_byte(int rs, uint8_t data) {
+	if (rs) {
+		if (address < sizeof(ddram))
+			ddram[address++] = data;
+	} else if (data & 0x80) {
+		address = data & 0x7F;
+	} else if (data == 0x01) {
+		lcd_show();
+		memset(ddram, 0, sizeof(ddram));
+		address = 0;
+	} else if ((data & 0xFE) == 0x02) {
+		address = 0;
+	}
+}
+
+void sim_lcd_write(uint8_t old, uint8_t value) {
+	if (!(old & LCD_ENABLE) || (value & LCD_ENABLE))
+		return;
+
+	if (nibbles < 4) {
+		nibbles++;
+		return;
+	}
+	if (nibbles++ & 1)
+		lcd_byte(old & LCD_RS, high | (old & 0x0F));
+	else
+		high = (old & 0x0F) << 4;
+}
+
+static void lcd_final(void) {
+	lcd_show();
+}
+
+__attribute__((constructor)) static void lcd_register(void) {
+	atexit(lcd_final);
+}
@@ -0,0 +1,149 @@
+/**
+ * sim_pilot.c: scripted pilot on USART0
+ *
+ * Reads a script from standard input and types it into the rover's serial port the way
+ * pilot.c does.  Each line is one of
+ *
+ *   <command>    sent as is, followed by a carriage return (e.g. "s1", "f050")
+ *   @<ms>        hold the following lines until the virtual clock reaches ms
+ *   +<ms>        hold the following lines for ms
+ *   ?<c>         hold the following lines until the rover sends character c
+ *   ?            hold the following lines until the rover sends any byte
+ *   # ...        comment
+ *
+ * The script starts when the rover enables its receiver, and a line is sent once the
+ * previous one has been fully received by the rover.  Bytes from the rover go to
+ * standard output; non-printing ones are written as <n>.  Every satisfied ?<c> reports
+ * how long the rover took since the last command was sent, which is the figure to watch
+ * when timing scans, and how many bytes came back meanwhile.  The rate is taken from the
+ * first of those bytes to the last, which is the serial throughput once the rover streams.  Like pilot.c, a ?<c> gives up after a while (ROVER_SIM_TIMEOUT ms,
+ * default 30000) and the script carries on.  Once the script ends the run stops after
+ * the link has been quiet for ROVER_SIM_LINGER ms (default 1000).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "sim.h"
+
+static int waiting_for = -1;	// character held on by ?<c>, 256 for any
+static int at_eof;
+static double linger_ms = 1000;
+static double timeout_ms = 30000;
+static double sent_ms;
+static unsigned long received;		// bytes from the rover since the last command
+static double first_ms;			// when the first of them arrived
+static char last_command[128];
+
+static void next_line(int arg);
+static void linger_done(int arg);
+static void answer_timeout(int arg);
+
+/// Quiet time before the run ends after the script has run out
+static void linger(void) {
+	sim_cancel(linger_done, 0);
+	sim_schedule(sim_now + (uint64_t) (linger_ms * SIM_CYCLES_PER_MS), linger_done, 0);
+}
+
+static void linger_done(int arg) {
+	(void) arg;
+	sim_finish("script done");
+}
+
+/// Work through the script until something has to be waited for
+static void next_line(int arg) {
+	char line[128];
+	size_t len;
+	int i;
+
+	(void) arg;
+	while (fgets(line, sizeof(line), stdin)) {
+		len = strcspn(line, "\r\n");
+		line[len] = 0;
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		if (line[0] == '@' || line[0] == '+') {
+			double ms = atof(line + 1) + (line[0] == '+' ? sim_ms() : 0);
+			if (ms > sim_ms()) {
+				sim_schedule((uint64_t) (ms * SIM_CYCLES_PER_MS), next_line, 0);
+				return;
+			}
+			continue;
+		}
+		if (line[0] == '?') {
+			waiting_for = line[1] ? (unsigned char) line[1] : 256;
+			sim_schedule(sim_now + (uint64_t) (timeout_ms * SIM_CYCLES_PER_MS), answer_timeout, 0);
+			return;
+		}
+
+		sim_trace("pilot: send \"%s\"", line);
+		snprintf(last_command, sizeof(last_command), "%s", line);
+		sent_ms = sim_ms();
+	received = 0;
+		for (i = 0; line[i]; i++)
+			sim_usart_send(0, line[i]);
+		sim_usart_send(0, '\r');
+		return;		// continues in sim_pilot_drained()
+	}
+	at_eof = 1;
+	linger();
+}
+
+static void answer_timeout(int arg) {
+	(void) arg;
+	fprintf(stderr, "pilot: \"%s\" got no answer within %.0f ms\n", last_command, timeout_ms);
+	waiting_for = -1;
+	next_line(0);
+}
+
+void sim_pilot_reset(void) {
+	const char *linger_env = getenv("ROVER_SIM_LINGER");
+	const char *timeout_env = getenv("ROVER_SIM_TIMEOUT");
+
+	if (linger_env)
+		linger_ms = atof(linger_env);
+	if (timeout_env)
+		timeout_ms = atof(timeout_env);
+}
+
+/// The script starts once the rover listens, like a pilot connecting after power-up
+void sim_pilot_start(void) {
+	static int started;
+
+	if (!started) {
+		started = 1;
+		next_line(0);
+	}
+}
+
+void sim_pilot_drained(void) {
+	next_line(0);
+}
+
+void sim_pilot_receive(uint8_t data) {
+	if (isprint(data))
+		putchar(data);
+	else
+		printf("<%d>", data);
+	if (data == 'z')
+		putchar('\n');
+	if (received++ == 0)
+		first_ms = sim_ms();
+
+	if (waiting_for == data || waiting_for == 256) {
+		double ms = sim_ms() - sent_ms;
+
+		waiting_for = -1;
+		sim_cancel(answer_timeout, 0);
+		fprintf(stderr, isprint(data) ? "pilot: \"%s\" answered '%c' after %.3f ms" : "pilot: \"%s\" answered <%d> after %.3f ms",
+		        last_command, data, ms);
+		if (received > 1)
+			fprintf(stderr, " (%lu bytes, %.0f bytes/s)", received, (received - 1) * 1000 / (sim_ms() - first_ms));
+		fputc('\n', stderr);
+		next_line(0);
+	}
+	if (at_eof)
+		linger();
+}
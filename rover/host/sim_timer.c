@@ -0,0 +1,173 @@
+/**
+ * sim_timer.c: emulated timer/counter 1 and 2
+ *
+ * Counters are not ticked one by one; each keeps the cycle at which it last held a known
+ * count and derives TCNT from the virtual clock.  Only compare matches, overflows and
+ * input captures become events.  Timer 3 runs the servo PWM and is modelled by the servo
+ * in sim_world.c.
+ */
+
+#include <avr/io.h>
+#include "sim.h"
+
+struct sim_counter {
+	int tccr;				// control register holding the clock select bits
+	unsigned max;			// 0xFF or 0xFFFF
+	uint64_t base;			// cycle at which the counter held base_count
+	unsigned base_count;
+	unsigned prescale;		// 0 when stopped
+};
+
+static struct sim_counter timer2 = { SFR_TCCR2, 0xFF };
+static struct sim_counter timer1 = { SFR_TCCR1B, 0xFFFF };
+
+static const unsigned prescalers[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+
+static void timer2_event(int arg);
+static void timer1_event(int arg);
+
+/// Top of timer 2: OCR2 in CTC mode, 0xFF otherwise
+static unsigned timer2_top(void) {
+	return (sim_reg[SFR_TCCR2] & _BV(WGM21)) ? sim_reg[SFR_OCR2] : 0xFF;
+}
+
+static unsigned counter_value(struct sim_counter *t, unsigned top) {
+	uint64_t ticks;
+
+	if (!t->prescale)
+		return t->base_count;
+	ticks = (sim_now - t->base) / t->prescale;
+	if (t->base_count > top) {
+		// Past the top after OCR was lowered: runs on to MAX and wraps first
+		if (ticks <= t->max - t->base_count)
+			return t->base_count + ticks;
+		ticks -= t->max - t->base_count + 1;
+		return ticks % (top + 1);
+	}
+	return (t->base_count + ticks) % (top + 1);
+}
+
+/// Cycles until the counter next reaches count, from a counter known to hold now_count
+static uint64_t cycles_to(struct sim_counter *t, unsigned now_count, unsigned count, unsigned top) {
+	unsigned ticks;
+
+	if (count > now_count)
+		ticks = count - now_count;
+	else
+		ticks = top - now_count + 1 + count;
+	return (uint64_t) ticks * t->prescale;
+}
+
+/// Re-read the clock select of a counter, keeping its current count
+static void counter_restart(struct sim_counter *t, unsigned count) {
+	t->base = sim_now;
+	t->base_count = count;
+	t->prescale = prescalers[sim_reg[t->tccr] & 0x07];
+}
+
+
+
+/// Timer 2 fires on OCR2 in CTC mode and on overflow otherwise
+static void timer2_schedule(void) {
+	unsigned top = timer2_top();
+	unsigned target = (sim_reg[SFR_TCCR2] & _BV(WGM21)) ? top : 0;
+
+	sim_cancel(timer2_event, 0);
+	if (!timer2.prescale)
+		return;
+	sim_schedule(sim_now + cycles_to(&timer2, counter_value(&timer2, top), target, top), timer2_event, 0);
+}
+
+static void timer2_event(int arg) {
+	(void) arg;
+	if (sim_reg[SFR_TCCR2] & _BV(WGM21)) {
+		sim_reg[SFR_TIFR] |= _BV(OCF2);
+		counter_restart(&timer2, timer2_top());
+	} else {
+		sim_reg[SFR_TIFR] |= _BV(TOV2);
+		counter_restart(&timer2, 0);
+	}
+	timer2_schedule();
+}
+
+
+
+/// Timer 1 runs in normal mode: overflow at 0xFFFF and an OCR1A compare match
+static void timer1_schedule(void) {
+	unsigned count = counter_value(&timer1, 0xFFFF);
+	uint64_t overflow, compare;
+
+	sim_cancel(timer1_event, 0);
+	sim_cancel(timer1_event, 1);
+	if (!timer1.prescale)
+		return;
+	overflow = cycles_to(&timer1, count, 0, 0xFFFF);
+	compare = cycles_to(&timer1, count, sim_reg[SFR_OCR1A], 0xFFFF);
+	sim_schedule(sim_now + overflow, timer1_event, 0);
+	sim_schedule(sim_now + compare, timer1_event, 1);
+}
+
+static void timer1_event(int arg) {
+	sim_reg[SFR_TIFR] |= arg ? _BV(OCF1A) : _BV(TOV1);
+	counter_restart(&timer1, counter_value(&timer1, 0xFFFF));
+	sim_cancel(timer1_event, !arg);
+	timer1_schedule();
+}
+
+/// Cycles until TCNT1 or TCNT2 next counts, 0 for other registers and stopped counters
+uint64_t sim_timer_poll(int id) {
+	struct sim_counter *t = id == SFR_TCNT1 ? &timer1 : id == SFR_TCNT2 ? &timer2 : 0;
+
+	if (!t || !t->prescale)
+		return 0;
+	return t->prescale - (sim_now - t->base) % t->prescale;
+}
+
+/// Edge on ICP1 (PD4); captures TCNT1 when it matches the edge selected by ICES1
+void sim_timer1_capture(int level) {
+	int rising = (sim_reg[SFR_TCCR1B] & _BV(ICES1)) != 0;
+
+	if (!timer1.prescale || rising != level)
+		return;
+	sim_reg[SFR_ICR1] = counter_value(&timer1, 0xFFFF);
+	sim_reg[SFR_TIFR] |= _BV(ICF1);
+}
+
+
+
+void sim_timer_reset(void) {
+	counter_restart(&timer2, 0);
+	counter_restart(&timer1, 0);
+}
+
+void sim_timer_write(int id, uint16_t old) {
+	switch (id) {
+		case SFR_TIFR:
+			// Flags are cleared by writing a one to them
+			sim_reg[SFR_TIFR] = old & ~sim_reg[SFR_TIFR];
+			break;
+		case SFR_TCCR2: case SFR_OCR2:
+			counter_restart(&timer2, counter_value(&timer2, timer2_top()));
+			timer2_schedule();
+			break;
+		case SFR_TCNT2:
+			counter_restart(&timer2, sim_reg[SFR_TCNT2]);
+			timer2_schedule();
+			break;
+		case SFR_TCCR1A: case SFR_TCCR1B: case SFR_OCR1A:
+			counter_restart(&timer1, counter_value(&timer1, 0xFFFF));
+			timer1_schedule();
+			break;
+		case SFR_TCNT1:
+			counter_restart(&timer1, sim_reg[SFR_TCNT1]);
+			timer1_schedule();
+			break;
+	}
+}
+
+void sim_timer_read(int id) {
+	if (id == SFR_TCNT2)
+		sim_reg[SFR_TCNT2] = counter_value(&timer2, timer2_top());
+	else
+		sim_reg[SFR_TCNT1] = counter_value(&timer1, 0xFFFF);
+}
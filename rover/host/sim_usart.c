@@ -0,0 +1,188 @@
+/**
+ * sim_usart.c: emulated USART0 (pilot link) and USART1 (Create link)
+ *
+ * Frames take their real time on the line at the programmed UBRR, U2X and stop bits.
+ * The transmitter has the AVR's one byte buffer in front of the shift register; the
+ * receiver has the two byte FIFO, and a byte arriving while it is full is lost (DOR).
+ * Bytes leaving the MCU reach the peer when their stop bit is done.
+ */
+
+#include <stdio.h>
+#include <avr/io.h>
+#include "sim.h"
+
+#define SIM_PEER_QUEUE 4096
+
+struct sim_usart {
+	int ubrrh, ubrrl, ucsra, ucsrb, ucsrc, udr;
+	void (*peer_receive)(uint8_t data);
+
+	uint8_t rx_fifo[2];
+	int rx_count;
+	int overrun;
+	uint8_t last_rx;
+
+	int tx_busy;			// shift register active
+	int tx_full;			// UDR buffer holds a byte
+	uint8_t tx_shift, tx_buffer;
+
+	uint8_t peer_queue[SIM_PEER_QUEUE];	// bytes on their way from the peer
+	int peer_head, peer_tail;
+	int peer_busy;
+};
+
+static struct sim_usart usarts[2] = {
+	{ SFR_UBRR0H, SFR_UBRR0L, SFR_UCSR0A, SFR_UCSR0B, SFR_UCSR0C, SFR_UDR0, sim_pilot_receive },
+	{ SFR_UBRR1H, SFR_UBRR1L, SFR_UCSR1A, SFR_UCSR1B, SFR_UCSR1C, SFR_UDR1, sim_create_receive },
+};
+
+static void tx_done(int unit);
+static void rx_arrive(int unit);
+
+static int unit_of(int id) {
+	return (id == SFR_UBRR0H || id == SFR_UBRR0L || id == SFR_UCSR0A || id == SFR_UCSR0B
+	        || id == SFR_UCSR0C || id == SFR_UDR0) ? 0 : 1;
+}
+
+/// Publish RXC, UDRE and DOR; TXC, U2X and MPCM live in the image itself
+static void refresh(struct sim_usart *u) {
+	uint16_t a = sim_reg[u->ucsra] & (_BV(TXC) | _BV(U2X) | _BV(MPCM));
+
+	if (u->rx_count)
+		a |= _BV(RXC);
+	if (!u->tx_full)
+		a |= _BV(UDRE);
+	if (u->overrun)
+		a |= _BV(DOR);
+	sim_reg[u->ucsra] = a;
+}
+
+uint64_t sim_usart_frame_cycles(int unit) {
+	struct sim_usart *u = &usarts[unit];
+	unsigned ubrr = ((sim_reg[u->ubrrh] & 0x0F) << 8) | sim_reg[u->ubrrl];
+	unsigned bits = 1 + 8 + ((sim_reg[u->ucsrc] & _BV(USBS)) ? 2 : 1);
+
+	if (sim_reg[u->ucsrc] & (3 << 4))
+		bits++;		// parity
+	return (uint64_t) bits * ((sim_reg[u->ucsra] & _BV(U2X)) ? 8 : 16) * (ubrr + 1);
+}
+
+static void tx_start(int unit) {
+	struct sim_usart *u = &usarts[unit];
+
+	u->tx_busy = 1;
+	sim_schedule(sim_now + sim_usart_frame_cycles(unit), tx_done, unit);
+}
+
+static void tx_done(int unit) {
+	struct sim_usart *u = &usarts[unit];
+
+	u->peer_receive(u->tx_shift);
+	if (u->tx_full) {
+		u->tx_shift = u->tx_buffer;
+		u->tx_full = 0;
+		tx_start(unit);
+	} else {
+		u->tx_busy = 0;
+		sim_reg[u->ucsra] |= _BV(TXC);
+	}
+	refresh(u);
+}
+
+/// Queue a byte from a peer towards the MCU
+void sim_usart_send(int unit, uint8_t data) {
+	struct sim_usart *u = &usarts[unit];
+	int next = (u->peer_tail + 1) % SIM_PEER_QUEUE;
+
+	if (next == u->peer_head) {
+		fprintf(stderr, "sim: USART%d peer queue full\n", unit);
+		return;
+	}
+	u->peer_queue[u->peer_tail] = data;
+	u->peer_tail = next;
+	if (!u->peer_busy) {
+		u->peer_busy = 1;
+		sim_schedule(sim_now + sim_usart_frame_cycles(unit), rx_arrive, unit);
+	}
+}
+
+static void rx_arrive(int unit) {
+	struct sim_usart *u = &usarts[unit];
+	uint8_t data = u->peer_queue[u->peer_head];
+
+	u->peer_head = (u->peer_head + 1) % SIM_PEER_QUEUE;
+	if (sim_reg[u->ucsrb] & _BV(RXEN)) {
+		if (u->rx_count < 2)
+			u->rx_fifo[u->rx_count++] = data;
+		else
+			u->overrun = 1;
+	}
+	refresh(u);
+
+	if (u->peer_head != u->peer_tail)
+		sim_schedule(sim_now + sim_usart_frame_cycles(unit), rx_arrive, unit);
+	else {
+		u->peer_busy = 0;
+		if (unit == 0)
+			sim_pilot_drained();
+	}
+}
+
+
+
+void sim_usart_reset(void) {
+	int i;
+
+	for (i = 0; i < 2; i++)
+		refresh(&usarts[i]);
+}
+
+void sim_usart_write(int id, uint16_t old) {
+	int unit = unit_of(id);
+	struct sim_usart *u = &usarts[unit];
+	uint8_t value = sim_reg[id];
+
+	if (id == u->udr) {
+		if (!(sim_reg[u->ucsrb] & _BV(TXEN)))
+			return;
+		if (!u->tx_busy) {
+			u->tx_shift = value;
+			tx_start(unit);
+		} else {
+			// Writing while UDRE is clear overwrites the waiting byte, as on the part
+			u->tx_buffer = value;
+			u->tx_full = 1;
+		}
+	} else if (id == u->ucsra) {
+		// TXC is cleared by writing a one to it; the other flags are read only
+		uint16_t txc = (old & _BV(TXC)) && !(value & _BV(TXC)) ? _BV(TXC) : 0;
+		sim_reg[id] = (value & (_BV(U2X) | _BV(MPCM))) | txc;
+	} else if (id == u->ucsrb) {
+		if (!(value & _BV(RXEN))) {
+			u->rx_count = 0;
+			u->overrun = 0;
+		} else if (!(old & _BV(RXEN)) && unit == 0) {
+			sim_pilot_start();
+		}
+	}
+	refresh(u);
+}
+
+/// UDR is handed out with 0x01 in the high byte so that a write can be told from a read
+void sim_usart_read(int id) {
+	struct sim_usart *u = &usarts[unit_of(id)];
+
+	sim_reg[id] = 0x100 | (u->rx_count ? u->rx_fifo[0] : u->last_rx);
+}
+
+void sim_usart_commit_read(int id) {
+	struct sim_usart *u = &usarts[unit_of(id)];
+
+	if (u->rx_count) {
+		u->last_rx = u->rx_fifo[0];
+		u->rx_fifo[0] = u->rx_fifo[1];
+		u->rx_count--;
+		u->overrun = 0;
+	}
+	refresh(u);
+}
@@ -0,0 +1,379 @@
+/**
+ * sim_world.c: the arena around the emulated rover
+ *
+ * Holds the rover pose, the posts in the arena and the scanner: a hobby servo on OC3B
+ * that slews towards the angle of the last pulse timer 3 put out, a PING))) sonar on PD4 (ICP1) and a Sharp IR
+ * ranger on ADC channel 2, both mounted on the servo.  Servo angle 0 looks to the right
+ * of the rover, 90 straight ahead and 180 to the left.
+ *
+ * An arena file (ROVER_SIM_SCENE) holds one item per line, lengths in cm:
+ *
+ *   post <x> <y> <radius>        cylinder to detect; the rover starts at 0,0 facing +x,
+ *                                +y is to its left
+ *   pose <x> <y> <heading>       start pose, heading in degrees counterclockwise from +x
+ *   zone <x> <y> <radius>        bright landing pad; all cliff signals read high on it
+ *   noise <ir_counts> <sonar_cm> spread of the sensor noise
+ *   spikes <percent>             share of pings answered by a stray echo
+ *   misses <percent>             share of pings the sonar never answers, not even with
+ *                                its no-echo pulse
+ *   beam <degrees>               half width of the sonar cone
+ *   servo <ms>                   servo slew time for 60 degrees (HS-311 datasheet: 190)
+ *   seed <n>                     noise generator seed
+ *
+ * Without a file the arena holds a few posts at varying range in front of the rover.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <avr/io.h>
+#include "sim.h"
+
+#define MAX_POSTS 32
+#define MAX_ZONES 4
+
+#define ROVER_RADIUS    17.0	// cm, Create body
+#define SENSOR_OFFSET   15.0	// cm, scanner ahead of the rover centre
+#define SONAR_RANGE     300.0	// cm
+#define SONAR_HOLDOFF   750		// us between the trigger and the echo pulse
+#define SONAR_NO_ECHO   18500	// us echo pulse when nothing answers
+#define IR_FLOOR        30		// ADC counts with nothing in front of the IR sensor
+#define SOUND_CM_PER_US 0.0343
+
+struct circle {
+	double x, y, r;
+};
+
+static struct circle posts[MAX_POSTS];
+static int post_count;
+static struct circle zones[MAX_ZONES];
+static int zone_count;
+
+static double rover_x, rover_y, rover_heading;
+static double ir_noise = 4, sonar_noise = 1, spike_percent = 0, miss_percent = 0, sonar_beam = 12;
+static double servo_ms_per_60 = 190;
+static uint32_t seed = 1;
+
+// Servo: moving from servo_from at servo_start towards servo_to
+static double servo_from, servo_to;
+static uint64_t servo_start;
+
+// Timer 3 runs PWM frames from timer3_origin; OCR3B is latched at the top of each frame
+static int timer3_prescale;
+static uint64_t timer3_origin;
+static int servo_latch_pending;
+
+// Sonar pin and echo state
+static int pin_level;
+static int echo_level;
+static int echo_pending;
+
+static void echo_event(int level);
+
+/// Uniform in [0, 1) from a small LCG, so runs repeat exactly
+static double uniform(void) {
+	seed = seed * 1103515245u + 12345u;
+	return ((seed >> 8) & 0xFFFFFF) / (double) 0x1000000;
+}
+
+/// Roughly normal, unit spread
+static double gauss(void) {
+	return (uniform() + uniform() + uniform() + uniform() - 2.0) * 1.732;
+}
+
+
+
+void sim_world_reset(void) {
+	static const struct circle arena[] = {
+		{ 60, -35, 5 },		// small post, right front
+		{ 90, 5, 8 },		// wide post ahead
+		{ 45, 40, 3 },		// goal post, left
+		{ 48, 55, 3 },		// goal post, left
+		{ 130, -70, 8 },	// beyond the detection range
+	};
+
+	memcpy(posts, arena, sizeof(arena));
+	post_count = sizeof(arena) / sizeof(arena[0]);
+	zone_count = 0;
+	rover_x = rover_y = rover_heading = 0;
+	servo_from = servo_to = 0;
+	timer3_prescale = 0;
+	servo_latch_pending = 0;
+}
+
+void sim_world_load(const char *path) {
+	FILE *f = fopen(path, "r");
+	char line[128], word[16];
+	double a, b, c;
+	int n;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+	post_count = 0;
+	while (fgets(line, sizeof(line), f)) {
+		n = sscanf(line, "%15s %lf %lf %lf", word, &a, &b, &c);
+		if (n < 1 || word[0] == '#')
+			continue;
+		if (!strcmp(word, "post") && n == 4 && post_count < MAX_POSTS)
+			posts[post_count++] = (struct circle) { a, b, c };
+		else if (!strcmp(word, "zone") && n == 4 && zone_count < MAX_ZONES)
+			zones[zone_count++] = (struct circle) { a, b, c };
+		else if (!strcmp(word, "pose") && n == 4) {
+			rover_x = a;
+			rover_y = b;
+			rover_heading = c;
+		} else if (!strcmp(word, "noise") && n == 3) {
+			ir_noise = a;
+			sonar_noise = b;
+		} else if (!strcmp(word, "spikes") && n == 2)
+			spike_percent = a;
+		else if (!strcmp(word, "misses") && n == 2)
+			miss_percent = a;
+		else if (!strcmp(word, "beam") && n == 2)
+			sonar_beam = a;
+		else if (!strcmp(word, "servo") && n == 2)
+			servo_ms_per_60 = a;
+		else if (!strcmp(word, "seed") && n == 2)
+			seed = (uint32_t) a;
+		else
+			fprintf(stderr, "%s: cannot parse '%s'\n", path, line);
+	}
+	fclose(f);
+}
+
+
+
+double sim_servo_angle(void) {
+	double moved = (double) (sim_now - servo_start) / SIM_CYCLES_PER_MS * 60.0 / servo_ms_per_60;
+
+	if (fabs(servo_to - servo_from) <= moved)
+		return servo_to;
+	return servo_to > servo_from ? servo_from + moved : servo_from - moved;
+}
+
+/// A pulse has ended on OC3B and the servo reads its width; the firmware maps 0-180 degrees onto 800 + 19.7 counts/degree
+static void servo_command(int width) {
+	double target = (width - 800) / 19.7;
+
+	if (target < 0)
+		target = 0;
+	if (target > 180)
+		target = 180;
+	servo_from = sim_servo_angle();
+	servo_to = target;
+	servo_start = sim_now;
+}
+
+/// Cycles in one PWM frame of timer 3 (fast PWM with OCR3A as TOP)
+static uint64_t timer3_frame(void) {
+	return (uint64_t) (sim_reg[SFR_OCR3A] + 1) * timer3_prescale;
+}
+
+/// Top of a frame: OCR3B moves out of its buffer and the pulse starts
+static void servo_latch(int unused) {
+	(void) unused;
+	servo_latch_pending = 0;
+	sim_schedule(sim_now + (uint64_t) sim_reg[SFR_OCR3B] * timer3_prescale, servo_command, sim_reg[SFR_OCR3B]);
+}
+
+/// New pulse width in the OCR3B buffer; it goes out with the next frame
+static void servo_buffer(void) {
+	uint64_t frame;
+
+	if (!timer3_prescale || servo_latch_pending)
+		return;
+	frame = timer3_frame();
+	servo_latch_pending = 1;
+	sim_schedule(timer3_origin + ((sim_now - timer3_origin) / frame + 1) * frame, servo_latch, 0);
+}
+
+/// Clock select of timer 3 changed: frames count from here
+static void timer3_clock(void) {
+	static const int prescale[8] = { 0, 1, 8, 64, 256, 1024, 0, 0 };
+	int was = timer3_prescale;
+
+	timer3_prescale = prescale[sim_reg[SFR_TCCR3B] & 0x07];
+	if (timer3_prescale && !was) {
+		timer3_origin = sim_now;
+		servo_latch(0);
+	}
+}
+
+/// Distance along a ray from the scanner to the nearest post, or -1
+static double ray(double bearing) {
+	double heading = (rover_heading + bearing) * M_PI / 180;
+	double dx = cos(heading), dy = sin(heading);
+	double sx = rover_x + SENSOR_OFFSET * cos(rover_heading * M_PI / 180);
+	double sy = rover_y + SENSOR_OFFSET * sin(rover_heading * M_PI / 180);
+	double best = -1;
+	int i;
+
+	for (i = 0; i < post_count; i++) {
+		double ox = posts[i].x - sx, oy = posts[i].y - sy;
+		double along = ox * dx + oy * dy;
+		double off2 = ox * ox + oy * oy - along * along;
+		double r2 = posts[i].r * posts[i].r;
+		double d;
+
+		if (along <= 0 || off2 > r2)
+			continue;
+		d = along - sqrt(r2 - off2);
+		if (d > 0 && (best < 0 || d < best))
+			best = d;
+	}
+	return best;
+}
+
+/// Servo angle to a bearing relative to the rover heading
+static double servo_bearing(void) {
+	return sim_servo_angle() - 90;
+}
+
+/// Nearest echo inside the sonar cone, in cm, or -1
+static double sonar_range(void) {
+	double bearing = servo_bearing(), best = -1, d;
+	int k;
+
+	if (spike_percent > 0 && uniform() * 100 < spike_percent)
+		return 10 + uniform() * (SONAR_RANGE - 10);
+	for (k = -(int) sonar_beam; k <= (int) sonar_beam; k++) {
+		d = ray(bearing + k);
+		if (d > 0 && d < SONAR_RANGE && (best < 0 || d < best))
+			best = d;
+	}
+	if (best > 0)
+		best += gauss() * sonar_noise;
+	return best;
+}
+
+/// Sharp GP2D12 style response, the inverse of the firmware's calibration points
+uint16_t sim_world_ir_adc(void) {
+	static const double cm[]  = { 10, 15, 20, 40, 60, 80 };
+	static const double adc[] = { 1000, 710, 500, 290, 220, 180 };
+	double d = ray(servo_bearing()), v;
+	int i;
+
+	if (d < 0)
+		v = IR_FLOOR;
+	else if (d <= cm[0])
+		v = adc[0] + (cm[0] - d) * 10;
+	else if (d >= cm[5])
+		v = adc[5] - (d - cm[5]) * 2;
+	else {
+		for (i = 1; d > cm[i]; i++)
+			;
+		v = adc[i - 1] + (d - cm[i - 1]) * (adc[i] - adc[i - 1]) / (cm[i] - cm[i - 1]);
+	}
+	if (v < IR_FLOOR)
+		v = IR_FLOOR;
+	v += gauss() * ir_noise;
+	if (v < 0)
+		v = 0;
+	if (v > 1023)
+		v = 1023;
+	return (uint16_t) v;
+}
+
+
+
+/// Level on ICP1: the port when PD4 drives it, the sonar's echo line otherwise
+static void sonar_pin_update(void) {
+	int level = (sim_reg[SFR_DDRD] & 0x10) ? (sim_reg[SFR_PORTD] & 0x10) != 0 : echo_level;
+
+	if (level == pin_level)
+		return;
+	pin_level = level;
+	sim_timer1_capture(level);
+
+	// A trigger pulse driven on PD4 starts a measurement once it falls.  The sensor wants
+	// 2 us of high, but the access cost model undercounts the code between the edges (a
+	// stale OCF2 ends wait_ms(1) at once), so any pulse counts.
+	if (sim_reg[SFR_DDRD] & 0x10) {
+		if (!level && !echo_pending && miss_percent > 0 && uniform() * 100 < miss_percent) {
+			sim_trace("sonar: ping at %.1f deg missed", sim_servo_angle());
+		} else if (!level && !echo_pending) {
+			double d = sonar_range();
+			uint64_t width = d > 0 ? (uint64_t) (2 * d / SOUND_CM_PER_US) : SONAR_NO_ECHO;
+
+			echo_pending = 1;
+			sim_schedule(sim_now + SONAR_HOLDOFF * SIM_CYCLES_PER_US, echo_event, 1);
+			sim_schedule(sim_now + (SONAR_HOLDOFF + width) * SIM_CYCLES_PER_US, echo_event, 0);
+			sim_trace("sonar: ping at %.1f deg, echo %.1f cm", sim_servo_angle(), d);
+		}
+	}
+}
+
+static void echo_event(int level) {
+	echo_level = level;
+	if (!level)
+		echo_pending = 0;
+	sonar_pin_update();
+}
+
+void sim_world_write(int id, uint16_t old) {
+	(void) old;
+	switch (id) {
+		case SFR_PORTD: case SFR_DDRD:
+			sonar_pin_update();
+			break;
+		case SFR_OCR3B:
+			servo_buffer();
+			break;
+		case SFR_TCCR3B:
+			timer3_clock();
+			break;
+	}
+}
+
+void sim_world_read(int id) {
+	switch (id) {
+		case SFR_PIND:
+			sim_reg[id] = (sim_reg[SFR_PORTD] & ~0x10) | (pin_level ? 0x10 : 0);
+			break;
+		case SFR_TCNT3:
+			sim_reg[id] = timer3_prescale ? (sim_now - timer3_origin) / timer3_prescale % (sim_reg[SFR_OCR3A] + 1) : 0;
+			break;
+	}
+}
+
+
+
+void sim_world_move(double distance_mm, double angle_deg) {
+	double heading = (rover_heading + angle_deg / 2) * M_PI / 180;
+
+	rover_x += distance_mm / 10 * cos(heading);
+	rover_y += distance_mm / 10 * sin(heading);
+	rover_heading += angle_deg;
+}
+
+/// Bumper bits as in sensor packet 7 (bit 0 right, bit 1 left) and the four cliff signals
+void sim_world_contacts(uint8_t *bumps, uint16_t cliff_signal[4]) {
+	uint16_t level = 200;
+	int i;
+
+	*bumps = 0;
+	for (i = 0; i < post_count; i++) {
+		double ox = posts[i].x - rover_x, oy = posts[i].y - rover_y;
+		double bearing;
+
+		if (sqrt(ox * ox + oy * oy) > ROVER_RADIUS + posts[i].r)
+			continue;
+		bearing = atan2(oy, ox) * 180 / M_PI - rover_heading;
+		while (bearing > 180)
+			bearing -= 360;
+		while (bearing < -180)
+			bearing += 360;
+		if (fabs(bearing) < 90)
+			*bumps |= bearing < 0 ? 0x01 : 0x02;
+	}
+	for (i = 0; i < zone_count; i++) {
+		double ox = zones[i].x - rover_x, oy = zones[i].y - rover_y;
+		if (sqrt(ox * ox + oy * oy) < zones[i].r)
+			level = 800;
+	}
+	for (i = 0; i < 4; i++)
+		cliff_signal[i] = level;
+}
@@ -0,0 +1,99 @@
+/**
+ * ir_table.c: IR ranger distance for each ADC value, generated by tools/ircal
+ *
+ * distance = 8826.75 / (adc - 69.5) + 0.445 cm, fitted to 6 points (rms 0.67 cm),
+ * clamped to 200 cm.  Regenerate with make ir_table rather than editing.
+ */
+
+#include <avr/pgmspace.h>
+#include "util.h"
+
+/// Distance in mm for each 10 bit ADC value
+const uint16_t ir_table_mm[1024] PROGMEM = {
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,  2000,
+	 2000,  2000,  2000,  2000,  2000,  2000,  1988,  1944,  1903,  1863,  1824,  1788,
+	 1752,  1718,  1686,  1654,  1624,  1595,  1567,  1540,  1513,  1488,  1463,  1440,
+	 1417,  1394,  1373,  1352,  1332,  1312,  1293,  1274,  1256,  1239,  1222,  1205,
+	 1189,  1174,  1158,  1143,  1129,  1115,  1101,  1087,  1074,  1062,  1049,  1037,
+	 1025,  1013,  1002,   991,   980,   969,   959,   948,   938,   929,   919,   910,
+	  901,   892,   883,   874,   866,   857,   849,   841,   833,   826,   818,   811,
+	  803,   796,   789,   782,   775,   769,   762,   756,   749,   743,   737,   731,
+	  725,   719,   713,   708,   702,   697,   691,   686,   681,   676,   671,   666,
+	  661,   656,   651,   646,   642,   637,   633,   628,   624,   620,   615,   611,
+	  607,   603,   599,   595,   591,   587,   583,   579,   576,   572,   568,   565,
+	  561,   558,   554,   551,   548,   544,   541,   538,   535,   531,   528,   525,
+	  522,   519,   516,   513,   510,   507,   505,   502,   499,   496,   493,   491,
+	  488,   485,   483,   480,   478,   475,   473,   470,   468,   465,   463,   461,
+	  458,   456,   454,   451,   449,   447,   445,   443,   440,   438,   436,   434,
+	  432,   430,   428,   426,   424,   422,   420,   418,   416,   414,   412,   410,
+	  408,   407,   405,   403,   401,   399,   398,   396,   394,   392,   391,   389,
+	  387,   386,   384,   382,   381,   379,   378,   376,   375,   373,   371,   370,
+	  368,   367,   365,   364,   363,   361,   360,   358,   357,   355,   354,   353,
+	  351,   350,   349,   347,   346,   345,   343,   342,   341,   339,   338,   337,
+	  336,   334,   333,   332,   331,   330,   328,   327,   326,   325,   324,   323,
+	  321,   320,   319,   318,   317,   316,   315,   314,   313,   311,   310,   309,
+	  308,   307,   306,   305,   304,   303,   302,   301,   300,   299,   298,   297,
+	  296,   295,   294,   293,   292,   291,   291,   290,   289,   288,   287,   286,
+	  285,   284,   283,   282,   282,   281,   280,   279,   278,   277,   276,   276,
+	  275,   274,   273,   272,   272,   271,   270,   269,   268,   268,   267,   266,
+	  265,   264,   264,   263,   262,   261,   261,   260,   259,   258,   258,   257,
+	  256,   256,   255,   254,   253,   253,   252,   251,   251,   250,   249,   249,
+	  248,   247,   247,   246,   245,   245,   244,   243,   243,   242,   241,   241,
+	  240,   240,   239,   238,   238,   237,   236,   236,   235,   235,   234,   233,
+	  233,   232,   232,   231,   230,   230,   229,   229,   228,   228,   227,   227,
+	  226,   225,   225,   224,   224,   223,   223,   222,   222,   221,   221,   220,
+	  219,   219,   218,   218,   217,   217,   216,   216,   215,   215,   214,   214,
+	  213,   213,   212,   212,   211,   211,   210,   210,   209,   209,   209,   208,
+	  208,   207,   207,   206,   206,   205,   205,   204,   204,   203,   203,   203,
+	  202,   202,   201,   201,   200,   200,   200,   199,   199,   198,   198,   197,
+	  197,   197,   196,   196,   195,   195,   194,   194,   194,   193,   193,   192,
+	  192,   192,   191,   191,   190,   190,   190,   189,   189,   189,   188,   188,
+	  187,   187,   187,   186,   186,   186,   185,   185,   184,   184,   184,   183,
+	  183,   183,   182,   182,   182,   181,   181,   180,   180,   180,   179,   179,
+	  179,   178,   178,   178,   177,   177,   177,   176,   176,   176,   175,   175,
+	  175,   174,   174,   174,   173,   173,   173,   172,   172,   172,   171,   171,
+	  171,   171,   170,   170,   170,   169,   169,   169,   168,   168,   168,   167,
+	  167,   167,   167,   166,   166,   166,   165,   165,   165,   164,   164,   164,
+	  164,   163,   163,   163,   162,   162,   162,   162,   161,   161,   161,   161,
+	  160,   160,   160,   159,   159,   159,   159,   158,   158,   158,   158,   157,
+	  157,   157,   157,   156,   156,   156,   155,   155,   155,   155,   154,   154,
+	  154,   154,   153,   153,   153,   153,   152,   152,   152,   152,   151,   151,
+	  151,   151,   150,   150,   150,   150,   150,   149,   149,   149,   149,   148,
+	  148,   148,   148,   147,   147,   147,   147,   146,   146,   146,   146,   146,
+	  145,   145,   145,   145,   144,   144,   144,   144,   144,   143,   143,   143,
+	  143,   142,   142,   142,   142,   142,   141,   141,   141,   141,   141,   140,
+	  140,   140,   140,   140,   139,   139,   139,   139,   138,   138,   138,   138,
+	  138,   137,   137,   137,   137,   137,   136,   136,   136,   136,   136,   136,
+	  135,   135,   135,   135,   135,   134,   134,   134,   134,   134,   133,   133,
+	  133,   133,   133,   132,   132,   132,   132,   132,   132,   131,   131,   131,
+	  131,   131,   130,   130,   130,   130,   130,   130,   129,   129,   129,   129,
+	  129,   129,   128,   128,   128,   128,   128,   127,   127,   127,   127,   127,
+	  127,   126,   126,   126,   126,   126,   126,   125,   125,   125,   125,   125,
+	  125,   124,   124,   124,   124,   124,   124,   123,   123,   123,   123,   123,
+	  123,   123,   122,   122,   122,   122,   122,   122,   121,   121,   121,   121,
+	  121,   121,   121,   120,   120,   120,   120,   120,   120,   119,   119,   119,
+	  119,   119,   119,   119,   118,   118,   118,   118,   118,   118,   118,   117,
+	  117,   117,   117,   117,   117,   117,   116,   116,   116,   116,   116,   116,
+	  116,   115,   115,   115,   115,   115,   115,   115,   114,   114,   114,   114,
+	  114,   114,   114,   113,   113,   113,   113,   113,   113,   113,   113,   112,
+	  112,   112,   112,   112,   112,   112,   112,   111,   111,   111,   111,   111,
+	  111,   111,   110,   110,   110,   110,   110,   110,   110,   110,   109,   109,
+	  109,   109,   109,   109,   109,   109,   108,   108,   108,   108,   108,   108,
+	  108,   108,   108,   107,   107,   107,   107,   107,   107,   107,   107,   106,
+	  106,   106,   106,   106,   106,   106,   106,   105,   105,   105,   105,   105,
+	  105,   105,   105,   105,   104,   104,   104,   104,   104,   104,   104,   104,
+	  104,   103,   103,   103,   103,   103,   103,   103,   103,   103,   102,   102,
+	  102,   102,   102,   102,   102,   102,   102,   101,   101,   101,   101,   101,
+	  101,   101,   101,   101,   101,   100,   100,   100,   100,   100,   100,   100,
+	  100,   100,   100,    99,    99,    99,    99,    99,    99,    99,    99,    99,
+	   99,    98,    98,    98,    98,    98,    98,    98,    98,    98,    98,    97,
+	   97,    97,    97,    97,
+};
@@ -5,6 +5,7 @@
  */
 
 #include <avr/io.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -175,10 +176,28 @@ void lcd_putc(char data) {
 	lcd_toggle_clear(1);
 }
 
+// Text lprintf() has asked for, drawn by lcd_step()
+static char lcd_text[LCD_TOTAL_CHARS + 1];
+static char *lcd_next;		// next character to draw, 0 when the display is up to date
+static char lcd_redraw;		// the display still has to be cleared
+static int lcd_charnum;
+
+/// Hand formatted text to lcd_step(), unless it is already showing
+static void lcd_show(const char *buffer) {
+	if (!strcmp(lcd_text, buffer))
+		return;
+	
+	strcpy(lcd_text, buffer);
+	lcd_next = lcd_text;
+	lcd_redraw = 1;
+	lcd_charnum = 0;
+}
+
 /// Print a formatted string to the LCD screen
 /**
  * Mimics the C library function printf for writing to the LCD screen.  The function is buffered; i.e. if you call
- * lprintf twice with the same string, it will only update the LCD the first time.
+ * lprintf twice with the same string, it will only update the LCD the first time.  The text is only formatted
+ * here; lcd_step() draws it a character at a time, and a new call starts over with the new text.
  *
  * Google "printf" for documentation on the formatter string.
  *
@@ -187,54 +206,71 @@ void lcd_putc(char data) {
  * @date 05/16/2012
  */
 void lprintf(const char *format, ...) {
-	static char lastbuffer[LCD_TOTAL_CHARS + 1];
-
 	char buffer[LCD_TOTAL_CHARS + 1];
 	va_list arglist;
 	va_start(arglist, format);
 	vsnprintf(buffer, LCD_TOTAL_CHARS + 1, format, arglist);
+	va_end(arglist);
 	
-	if (!strcmp(lastbuffer, buffer))
-		return;
+	lcd_show(buffer);
+}
+
+/// lprintf() with the format in program memory, e.g. lprintf_P(PSTR("x: %d"), x)
+void lprintf_P(PGM_P format, ...) {
+	char buffer[LCD_TOTAL_CHARS + 1];
+	va_list arglist;
+	va_start(arglist, format);
+	vsnprintf_P(buffer, LCD_TOTAL_CHARS + 1, format, arglist);
+	va_end(arglist);
 	
-	strcpy(lastbuffer, buffer);
-	lcd_clear();
-	char *str = buffer;
-	int charnum = 0;
-	while (*str && charnum < LCD_TOTAL_CHARS) {
-		if (*str == '\n') {
-			/* fill remainder of line with spaces */
-			charnum += LCD_WIDTH - charnum % LCD_WIDTH;
-		} else {
-			lcd_putc(*str);
-			charnum++;
-		}
+	lcd_show(buffer);
+}
 
-		str++;
-		
-		/*
-		 * The LCD's lines are not sequential; for future reference, the address are like
-		 * 0x00...0x13 : line 1
-		 * 0x14...0x27 : line 3
-		 * 0x28...0x3F : random junk
-		 * 0x40...0x53 : line 2
-		 * 0x54...0x68 : line 4
-		 * 
-		 * The cursor position must be reset at the end of every line, otherwise, after writing line 1, it writes line 3 and then nothingness
-		 */
-		
-		if (charnum % LCD_WIDTH == 0) { 
-			switch (charnum / LCD_WIDTH) {
-			case 1:
-				lcd_home_line2();
-				break;
-			case 2:
-				lcd_home_line3();
-				break;
-			case 3:
-				lcd_home_line4();
-			}
+/// LCD task: clears the display, then draws one character of the lprintf() text per step
+void lcd_step(void) {
+	if (!lcd_next)
+		return;
+	if (lcd_redraw) {
+		lcd_clear();
+		lcd_redraw = 0;
+		return;
+	}
+	if (!*lcd_next || lcd_charnum >= LCD_TOTAL_CHARS) {
+		lcd_next = 0;
+		return;
+	}
+
+	if (*lcd_next == '\n') {
+		/* fill remainder of line with spaces */
+		lcd_charnum += LCD_WIDTH - lcd_charnum % LCD_WIDTH;
+	} else {
+		lcd_putc(*lcd_next);
+		lcd_charnum++;
+	}
+
+	lcd_next++;
+	
+	/*
+	 * The LCD's lines are not sequential; for future reference, the address are like
+	 * 0x00...0x13 : line 1
+	 * 0x14...0x27 : line 3
+	 * 0x28...0x3F : random junk
+	 * 0x40...0x53 : line 2
+	 * 0x54...0x68 : line 4
+	 * 
+	 * The cursor position must be reset at the end of every line, otherwise, after writing line 1, it writes line 3 and then nothingness
+	 */
+	
+	if (lcd_charnum % LCD_WIDTH == 0) { 
+		switch (lcd_charnum / LCD_WIDTH) {
+		case 1:
+			lcd_home_line2();
+			break;
+		case 2:
+			lcd_home_line3();
+			break;
+		case 3:
+			lcd_home_line4();
 		}
 	}
-	va_end(arglist);
 }
@@ -1,3 +1,5 @@
+#include <avr/pgmspace.h>
+
 /// Initializes PORTA to communicate with LCD controller
 void lcd_init(void);
 
@@ -10,6 +12,12 @@ void lcd_home_line4(void);
 /// Prints a string to the lcd; Google "printf" for documentation.
 void lprintf(const char *formatter, ...);
 
+/// lprintf() with the format in program memory, e.g. lprintf_P(PSTR("x: %d"), x)
+void lprintf_P(PGM_P formatter, ...);
+
+/// LCD task, draws the text from lprintf() a character per step
+void lcd_step(void);
+
 /// Prints a string of characters starting at the current cursor position
 void lcd_puts(char *data);
 
@@ -1,7 +1,44 @@
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <avr/interrupt.h>
+#include "hal.h"
 #include "util.h"
 #include "open_interface.h"
 
+// USART1 ring buffers, filled and drained by the interrupts below
+static volatile unsigned char oi_rx_buf[OI_RX_SIZE];
+static volatile unsigned char oi_tx_buf[OI_TX_SIZE];
+static volatile unsigned char oi_rx_head, oi_rx_tail;
+static volatile unsigned char oi_tx_head, oi_tx_tail;
+static unsigned char oi_tx_active; // bytes went out since the last oi_flush()
+
+// Packet assembler: collects the reply to the last query
+static unsigned char oi_frame[OI_FRAME_SIZE];
+static unsigned char oi_frame_len, oi_frame_need;
+static unsigned char oi_frame_pending; // a query is out and its reply not yet complete
+static unsigned char oi_query_ids[OI_QUERY_MAX];
+static unsigned char oi_query_count;
+
+static unsigned char oi_packet_size(unsigned char id);
+static void oi_decode(oi_t *self, unsigned char id, const unsigned char *data);
+
+// Stream mode: the Create sends these packets every 15 ms (32 bytes a frame, well inside
+// what 28800 baud carries in that time) and the receive interrupt parses each frame into
+// the back buffer of a pair of oi_t, then flips it to the front
+static const uint8_t oi_stream_packets[] = { 7, 9, 10, 11, 12, 13, 19, 20, 28, 29, 30, 31 };
+static oi_t oi_stream_buf[2];
+static volatile unsigned char oi_stream_front;	// buffer holding the newest good frame
+static volatile unsigned char oi_stream_seq;	// bumped for every good frame
+static unsigned char oi_stream_seen;			// seq at the last oi_stream_read()
+static volatile int16_t oi_stream_distance, oi_stream_angle;	// summed since the last read
+static volatile unsigned char oi_streaming;
+volatile unsigned int oi_stream_errors;
+
+// Stream frame parser state: 19, length, id and data for each packet, checksum
+static unsigned char oi_parse_buf[OI_STREAM_MAX];
+static unsigned char oi_parse_state, oi_parse_len, oi_parse_count, oi_parse_sum;
+
 /// Allocate memory for a the sensor data
 oi_t* oi_alloc() {
 	return calloc(1, sizeof(oi_t));
@@ -14,16 +51,28 @@ void oi_free(oi_t *self) {
 
 /// Initialize the Create
 void oi_init(oi_t *self) {
+	// Pause a running stream and let anything still queued go out at the old baud rate
+	if (oi_streaming) {
+		oi_byte_tx(OI_OPCODE_DO_STREAM);
+		oi_byte_tx(0);
+		oi_streaming = 0;
+	}
+	oi_flush();
+	oi_rx_head = oi_rx_tail = 0;
+	oi_frame_pending = 0;
+
 	// Setup USART1 to communicate to the iRobot Create using serial (baud = 57600)
 	UBRR1L = 16; // UBRR = (FOSC/16/BAUD-1);
-	UCSR1B = (1 << RXEN) | (1 << TXEN);
+	UCSR1B = (1 << RXCIE) | (1 << RXEN) | (1 << TXEN);
 	UCSR1C = (3 << UCSZ10);
+	sei();
 
 	// Starts the SCI. Must be sent first
 	oi_byte_tx(OI_OPCODE_START);
 	oi_byte_tx(OI_OPCODE_BAUD);
 
 	oi_byte_tx(8); // baud code for 28800
+	oi_flush();
 	wait_ms(100);
 	
 	// Set the baud rate on the Cerebot II to match the Create's baud
@@ -33,53 +82,304 @@ void oi_init(oi_t *self) {
 	oi_byte_tx(OI_OPCODE_FULL);
 	oi_set_leds(1, 1, 7, 255);
 	
-	oi_update(self);
-	oi_update(self); // call twice to clear distance/angle
+	// Read distance and angle once to clear them
+	static const unsigned char odometry[] = { 19, 20 };
+	oi_query(self, odometry, 2);
+
+	oi_stream_start();
 }
 
 
 
 /// Update the Create. This will update all the sensor data and store it in the oi_t struct.
+/**
+* While streaming this waits for the next frame and only the streamed packets are fresh.
+*/
 void oi_update(oi_t *self) {
-	int i;
+	static const unsigned char group6[] = { OI_SENSOR_PACKET_GROUP6 };
+	oi_query(self, group6, 1);
+}
 
-	// Clear the receive buffer
-	while (UCSR1A & (1 << RXC)) 
-		i = UDR1;
 
-	// Query a list of sensor values
-	oi_byte_tx(OI_OPCODE_SENSORS);
-	// Send the sensor packet ID
-	oi_byte_tx(OI_SENSOR_PACKET_GROUP6); 
 
-	// Read all the sensor data
-	char *sensor = (char *) self;
-	for (i = 0; i < 52; i++) {
-		// read each sensor byte
-		*(sensor++) = oi_byte_rx();
+/// Fetch just the listed packets (or groups) and store them in self
+/**
+* While streaming this waits for the next streamed frame instead.
+* @return 1 once stored, 0 if the query could not be sent (see oi_query_start())
+*/
+int oi_query(oi_t *self, const unsigned char *ids, unsigned char count) {
+	if (oi_streaming) {
+		while (!oi_stream_read(self))
+			hal_idle();
+		return 1;
+	}
+	if (!oi_query_start(ids, count))
+		return 0;
+	while (!oi_poll(self))
+		hal_idle();
+	return 1;
+}
+
+
+
+/// Ask the Create for a list of packets unless a query is already on its way
+/**
+* @return 1 if sent, 0 if a query is pending, there are too many ids, one of them is not
+* a packet or group, or the reply would not fit in a frame
+*/
+int oi_query_start(const unsigned char *ids, unsigned char count) {
+	unsigned char i, size;
+	unsigned need = 0;
+
+	if (oi_frame_pending || count > OI_QUERY_MAX)
+		return 0;
+	for (i = 0; i < count; i++) {
+		size = oi_packet_size(ids[i]);
+		if (!size)
+			return 0;
+		need += size;
+	}
+	if (need > OI_FRAME_SIZE)
+		return 0;
+
+	// Drop anything stale so the reply lines up with the assembler
+	oi_rx_tail = oi_rx_head;
+	oi_frame_len = 0;
+	oi_frame_need = need;
+	oi_query_count = count;
+	memcpy(oi_query_ids, ids, count);
+	oi_frame_pending = 1;
+
+	oi_byte_tx(OI_OPCODE_QUERY_LIST);
+	oi_byte_tx(count);
+	for (i = 0; i < count; i++)
+		oi_byte_tx(ids[i]);
+	return 1;
+}
+
+
+
+/// Feed received bytes to the packet assembler; stores a completed reply in self
+int oi_poll(oi_t *self) {
+	unsigned char i, n = 0;
+
+	if (!oi_frame_pending)
+		return 0;
+
+	while (oi_rx_tail != oi_rx_head && oi_frame_len < oi_frame_need) {
+		oi_frame[oi_frame_len++] = oi_rx_buf[oi_rx_tail];
+		oi_rx_tail = (oi_rx_tail + 1) & (OI_RX_SIZE - 1);
+	}
+	if (oi_frame_len < oi_frame_need)
+		return 0;
+	oi_frame_pending = 0;
+
+	for (i = 0; i < oi_query_count; i++) {
+		oi_decode(self, oi_query_ids[i], &oi_frame[n]);
+		n += oi_packet_size(oi_query_ids[i]);
+	}
+	return 1;
+}
+
+
+
+// Where each of packets 7-42 lives in oi_t. The struct follows the group 6 layout, so the
+// bit packets land on their bitfields as they are; two byte packets arrive big endian.
+#define OI_FIELD(field)  offsetof(oi_t, field)
+
+static const struct oi_packet {
+	unsigned char offset;
+	unsigned char size;		// in bytes; the type of the field gives the sign
+} oi_packets[] = {
+	{ 0, 1 },											// 7 bumps and wheel drops
+	{ OI_FIELD(wall), 1 },								// 8
+	{ OI_FIELD(cliff_left), 1 },						// 9
+	{ OI_FIELD(cliff_frontleft), 1 },					// 10
+	{ OI_FIELD(cliff_frontright), 1 },					// 11
+	{ OI_FIELD(cliff_right), 1 },						// 12
+	{ OI_FIELD(virtual_wall), 1 },						// 13
+	{ OI_FIELD(virtual_wall) + 1, 1 },					// 14 overcurrents
+	{ OI_FIELD(unused_bytes), 1 },						// 15
+	{ OI_FIELD(unused_bytes) + 1, 1 },					// 16
+	{ OI_FIELD(infrared_byte), 1 },						// 17
+	{ OI_FIELD(infrared_byte) + 1, 1 },					// 18 buttons
+	{ OI_FIELD(distance), 2 },							// 19
+	{ OI_FIELD(angle), 2 },								// 20
+	{ OI_FIELD(charging_state), 1 },					// 21
+	{ OI_FIELD(voltage), 2 },							// 22
+	{ OI_FIELD(current), 2 },							// 23
+	{ OI_FIELD(temperature), 1 },						// 24
+	{ OI_FIELD(charge), 2 },							// 25
+	{ OI_FIELD(capacity), 2 },							// 26
+	{ OI_FIELD(wall_signal), 2 },						// 27
+	{ OI_FIELD(cliff_left_signal), 2 },					// 28
+	{ OI_FIELD(cliff_frontleft_signal), 2 },			// 29
+	{ OI_FIELD(cliff_frontright_signal), 2 },			// 30
+	{ OI_FIELD(cliff_right_signal), 2 },				// 31
+	{ OI_FIELD(cargo_bay_voltage) - 1, 1 },				// 32 cargo bay inputs
+	{ OI_FIELD(cargo_bay_voltage), 2 },					// 33
+	{ OI_FIELD(oi_mode) - 1, 1 },						// 34 charging sources
+	{ OI_FIELD(oi_mode), 1 },							// 35
+	{ OI_FIELD(song_number), 1 },						// 36
+	{ OI_FIELD(song_playing), 1 },						// 37
+	{ OI_FIELD(number_packets), 1 },					// 38
+	{ OI_FIELD(requested_velocity), 2 },				// 39
+	{ OI_FIELD(requested_radius), 2 },					// 40
+	{ OI_FIELD(requested_right_velocity), 2 },			// 41
+	{ OI_FIELD(requested_left_velocity), 2 },			// 42
+};
+
+// First and last packet of groups 0-6
+static const unsigned char oi_groups[7][2] = {
+	{ 7, 26 }, { 7, 16 }, { 17, 20 }, { 21, 26 }, { 27, 34 }, { 35, 42 }, { 7, 42 }
+};
+
+/// Size of a packet or group, 0 for ids that are neither
+static unsigned char oi_packet_size(unsigned char id) {
+	unsigned char size = 0, last;
+
+	if (id <= OI_SENSOR_PACKET_GROUP6) {
+		for (last = oi_groups[id][1], id = oi_groups[id][0]; id <= last; id++)
+			size += oi_packets[id - 7].size;
+		return size;
+	}
+	if (id > 42)
+		return 0;
+	return oi_packets[id - 7].size;
+}
+
+/// Store a packet or group, as it came from the Create, in the struct
+static void oi_decode(oi_t *self, unsigned char id, const unsigned char *data) {
+	unsigned char *field;
+	unsigned char last;
+
+	if (id <= OI_SENSOR_PACKET_GROUP6) {
+		for (last = oi_groups[id][1], id = oi_groups[id][0]; id <= last; id++) {
+			oi_decode(self, id, data);
+			data += oi_packets[id - 7].size;
+		}
+		return;
+	}
+	field = (unsigned char *) self + oi_packets[id - 7].offset;
+	if (oi_packets[id - 7].size == 2) {
+		field[0] = data[1];
+		field[1] = data[0];
+	} else {
+		field[0] = data[0];
+	}
+}
+
+/// Decode a checksummed stream frame into the back buffer and make it the front one
+static void oi_stream_frame(void) {
+	unsigned char back = oi_stream_front ^ 1;
+	oi_t *self = &oi_stream_buf[back];
+	unsigned char i = 0, size;
+
+	*self = oi_stream_buf[oi_stream_front];
+	self->distance = 0;
+	self->angle = 0;
+	while (i < oi_parse_len) {
+		size = oi_packet_size(oi_parse_buf[i]);
+		if (!size || i + 1 + size > oi_parse_len) {
+			oi_stream_errors++;
+			return;
+		}
+		oi_decode(self, oi_parse_buf[i], &oi_parse_buf[i + 1]);
+		i += 1 + size;
+	}
+	oi_stream_distance += self->distance;
+	oi_stream_angle += self->angle;
+	oi_stream_front = back;
+	oi_stream_seq++;
+}
+
+/// Run one received byte through the stream frame parser (called from the RX interrupt)
+static void oi_stream_byte(unsigned char value) {
+	switch (oi_parse_state) {
+		case 0: // header
+			if (value == 19) {
+				oi_parse_sum = value;
+				oi_parse_state = 1;
+			}
+			break;
+		case 1: // length
+			if (value > OI_STREAM_MAX) {
+				oi_stream_errors++;
+				oi_parse_state = 0;
+				break;
+			}
+			oi_parse_len = value;
+			oi_parse_count = 0;
+			oi_parse_sum += value;
+			oi_parse_state = value ? 2 : 3;
+			break;
+		case 2: // packets
+			oi_parse_buf[oi_parse_count++] = value;
+			oi_parse_sum += value;
+			if (oi_parse_count == oi_parse_len)
+				oi_parse_state = 3;
+			break;
+		default: // checksum; everything from the header on sums to zero
+			oi_parse_state = 0;
+			if ((unsigned char) (oi_parse_sum + value))
+				oi_stream_errors++;
+			else
+				oi_stream_frame();
+			break;
 	}
-	
-	sensor = (char *) self;
-	
-	// Fix byte ordering for multi-byte members of the struct
-	self->distance                 = (sensor[12] << 8) + sensor[13];
-	self->angle                    = (sensor[14] << 8) + sensor[15];
-	self->voltage                  = (sensor[17] << 8) + sensor[18];
-	self->current                  = (sensor[19] << 8) + sensor[20];
-	self->charge                   = (sensor[22] << 8) + sensor[23];
-	self->capacity                 = (sensor[24] << 8) + sensor[25];
-	self->wall_signal              = (sensor[26] << 8) + sensor[27];
-	self->cliff_left_signal        = (sensor[28] << 8) + sensor[29];
-	self->cliff_frontleft_signal   = (sensor[30] << 8) + sensor[31]; 
-	self->cliff_frontright_signal  = (sensor[32] << 8) + sensor[33];
-	self->cliff_right_signal       = (sensor[34] << 8) + sensor[35];
-	self->cargo_bay_voltage        = (sensor[41] << 8) + sensor[42];
-	self->requested_velocity       = (sensor[48] << 8) + sensor[42];
-	self->requested_radius         = (sensor[50] << 8) + sensor[51];
-	self->requested_right_velocity = (sensor[52] << 8) + sensor[53];
-	self->requested_left_velocity  = (sensor[54] << 8) + sensor[55];
-	
-	wait_ms(5); // reduces USART errors that occur when continuously transmitting/receiving
+}
+
+
+
+/// Have the Create stream the bump, cliff and odometry packets every 15 ms
+void oi_stream_start(void) {
+	unsigned char i;
+
+	oi_stream_distance = oi_stream_angle = 0;
+	oi_stream_seen = oi_stream_seq;
+	oi_parse_state = 0;
+	oi_streaming = 1;
+
+	oi_byte_tx(OI_OPCODE_STREAM);
+	oi_byte_tx(sizeof(oi_stream_packets));
+	for (i = 0; i < sizeof(oi_stream_packets); i++)
+		oi_byte_tx(oi_stream_packets[i]);
+}
+
+
+
+/// Forget the distance and angle streamed so far and any frame not read yet
+void oi_stream_clear(void) {
+	cli();
+	oi_stream_distance = oi_stream_angle = 0;
+	oi_stream_seen = oi_stream_seq;
+	sei();
+}
+
+
+
+/// Copy the newest streamed frame, if there is one the caller has not seen yet
+int oi_stream_read(oi_t *self) {
+	unsigned char seq, front;
+
+	if (oi_stream_seen == oi_stream_seq)
+		return 0;
+
+	// The interrupt only writes the back buffer; copy again if it flipped meanwhile
+	do {
+		seq = oi_stream_seq;
+		front = oi_stream_front;
+		*self = oi_stream_buf[front];
+	} while (seq != oi_stream_seq);
+	oi_stream_seen = seq;
+
+	// Distance and angle count from the previous read, however many frames that spans
+	cli();
+	self->distance = oi_stream_distance;
+	self->angle = oi_stream_angle;
+	oi_stream_distance = oi_stream_angle = 0;
+	sei();
+	return 1;
 }
 
 
@@ -131,6 +431,19 @@ void oi_load_song(int song_index, int num_notes, unsigned char *notes, unsigned
 }
 
 
+/// oi_load_song() with the notes and durations in program memory
+void oi_load_song_P(int song_index, int num_notes, const unsigned char *notes, const unsigned char *duration) {
+	int i;
+	oi_byte_tx(OI_OPCODE_SONG);
+	oi_byte_tx(song_index);
+	oi_byte_tx(num_notes);
+	for (i=0;i<num_notes;i++) {
+		oi_byte_tx(pgm_read_byte(&notes[i]));
+		oi_byte_tx(pgm_read_byte(&duration[i]));
+	}
+}
+
+
 /// Plays a given song; use oi_load_song(...) first
 void oi_play_song(int index){
 	oi_byte_tx(OI_OPCODE_PLAY);
@@ -157,20 +470,70 @@ void go_charge(void) {
 
 
 
-// Transmit a byte of data over the serial connection to the Create
+// Queue a byte of data for the Create. Only waits while the transmit ring is full.
 void oi_byte_tx(unsigned char value) {
-	// Wait until the transmit buffer is empty
-	while (!(UCSR1A & (1 << UDRE)));
-
-	UDR1 = value;
+	unsigned char next = (oi_tx_head + 1) & (OI_TX_SIZE - 1);
+
+	while (next == oi_tx_tail)
+		hal_idle();
+	oi_tx_buf[oi_tx_head] = value;
+	oi_tx_head = next;
+	if (!oi_tx_active) {
+		//TXC is cleared by writing a one, so oi_flush() sees this batch end; keep U2X and MPCM
+		//and write no other flag back
+		UCSR1A = (UCSR1A & ((1 << U2X) | (1 << MPCM))) | (1 << TXC);
+		oi_tx_active = 1;
+	}
+	UCSR1B |= (1 << UDRIE);
 }
 
 
 
 // Receive a byte of data from the Create serial connection. Blocks until a byte is received.
 unsigned char oi_byte_rx(void) {
-	// wait until a byte is received (Receive Complete flag, RXC, is set)
-	while (!(UCSR1A & (1 << RXC)));
+	unsigned char value;
 
-	return UDR1;
+	while (oi_rx_tail == oi_rx_head)
+		hal_idle();
+	value = oi_rx_buf[oi_rx_tail];
+	oi_rx_tail = (oi_rx_tail + 1) & (OI_RX_SIZE - 1);
+	return value;
+}
+
+
+
+// Wait until every queued byte has left the shift register
+void oi_flush(void) {
+	if (!oi_tx_active)
+		return;
+	while (oi_tx_tail != oi_tx_head || !(UCSR1A & (1 << TXC)))
+		hal_idle();
+	oi_tx_active = 0;
+}
+
+
+
+// USART1 receive interrupt, moves the byte into the receive ring
+ISR (USART1_RX_vect) {
+	unsigned char value = UDR1;
+	unsigned char next = (oi_rx_head + 1) & (OI_RX_SIZE - 1);
+
+	if (oi_streaming)
+		oi_stream_byte(value);
+	else if (next != oi_rx_tail) {
+		oi_rx_buf[oi_rx_head] = value;
+		oi_rx_head = next;
+	}
+}
+
+
+
+// USART1 data register empty interrupt, feeds the next queued byte
+ISR (USART1_UDRE_vect) {
+	if (oi_tx_tail == oi_tx_head) {
+		UCSR1B &= ~(1 << UDRIE);
+		return;
+	}
+	UDR1 = oi_tx_buf[oi_tx_tail];
+	oi_tx_tail = (oi_tx_tail + 1) & (OI_TX_SIZE - 1);
 }
@@ -71,6 +71,19 @@
 // Contains Packets 7-42
 #define OI_SENSOR_PACKET_GROUP6 6
 
+// Longest query reply, the size of sensor group 6
+#define OI_FRAME_SIZE 52
+
+// Most packet ids in one query
+#define OI_QUERY_MAX 16
+
+// Longest stream frame payload the parser accepts
+#define OI_STREAM_MAX 64
+
+// USART1 ring buffer sizes, powers of two
+#define OI_RX_SIZE 64
+#define OI_TX_SIZE 64
+
 #define MIN(a,b) ((a < b) ? (a) : (b))
 #define MAX(a,b) ((a > b) ? (a) : (b))
 
@@ -84,7 +97,11 @@
 #define PIN_7 0x80
 
 /// iRobot Create Sensor Data
-typedef struct {
+/**
+* oi_update() reads the raw sensor bytes straight into this struct, so it is packed
+* to keep the AVR byte layout when built for the host
+*/
+typedef struct __attribute__((packed)) {
 	// Sensor statuses (booleans)
 	uint8_t bumper_right : 1;
 	uint8_t bumper_left : 1;
@@ -165,6 +182,39 @@ void oi_free(oi_t *self);
 /// Update the Create. This will update all the sensor data.
 void oi_update(oi_t *self);
 
+/// \brief Fetch only the listed sensor packets (Query List). Waits for the reply.
+/// \param self struct to store the packets in; other fields are left alone
+/// \param ids packet ids 7-42, or groups 0-6
+/// \param count number of ids, at most OI_QUERY_MAX
+/// \return 1 once the reply is stored, 0 if the query could not be sent
+int oi_query(oi_t *self, const unsigned char *ids, unsigned char count);
+
+/// \brief Send a Query List without waiting for the reply.
+/// Does nothing while the previous query is still being answered.
+/// \return 1 if sent; 0 if a query is pending, count is over OI_QUERY_MAX, an id is not
+/// a packet 7-42 or group 0-6, or the reply would not fit in OI_FRAME_SIZE
+int oi_query_start(const unsigned char *ids, unsigned char count);
+
+/// \brief Collect what has arrived of the reply to oi_query_start()
+/// \param self struct to store the packets in once the reply is complete
+/// \return 1 if a complete reply was stored, 0 if it is still on its way
+int oi_poll(oi_t *self);
+
+/// \brief Start stream mode (oi_init() does this). The Create then sends the bump, cliff,
+/// wall and odometry packets every 15 ms and the receive interrupt keeps a snapshot.
+void oi_stream_start(void);
+
+/// \brief Copy the newest streamed sensor snapshot
+/// \param self struct to copy into; distance and angle are summed since the previous read
+/// \return 1 if there was a frame the caller had not read yet, 0 otherwise
+int oi_stream_read(oi_t *self);
+
+/// \brief Forget the distance and angle streamed so far and any frame not read yet
+void oi_stream_clear(void);
+
+/// Stream frames dropped for a bad checksum or length
+extern volatile unsigned int oi_stream_errors;
+
 /// \brief Set the LEDS on the Create
 /// \param play_led 0=off, 1=on
 /// \param advance_led 0=off, 1=on
@@ -186,6 +236,9 @@ void oi_byte_tx(unsigned char value);
 /// \return 8-bit value returned from the Create
 unsigned char oi_byte_rx(void);
 
+/// \brief Wait until every queued byte has been sent to the Create
+void oi_flush(void);
+
 /// \brief Load song sequence
 /// \param An integer value from 0 - 15 that acts as a label for note sequence
 /// \param An integer value from 1 - 16 indicating the number of notes in the sequence
@@ -193,6 +246,9 @@ unsigned char oi_byte_rx(void);
 /// \param A pointer to a sequence of durations that correspond to the notes
 void oi_load_song(int song_index, int num_notes, unsigned char  *notes, unsigned char  *duration);
 
+/// oi_load_song() with the notes and durations in program memory
+void oi_load_song_P(int song_index, int num_notes, const unsigned char *notes, const unsigned char *duration);
+
 /// \brief Play song
 /// \param An integer value from 0 - 15 that is a previously establish song index
 void oi_play_song(int index);
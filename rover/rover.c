@@ -8,32 +8,46 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <ctype.h>
 #include <avr/interrupt.h>
 #include "util.h"
 #include "open_interface.h"
 #include "lcd.h"
+#include "rover.h"
+#include "sched.h"
 
 
-int rcv[10];
-	
+// Command line being received, assembled by command_step()
+char rcv[11];
+static unsigned char rcv_len;
+
+// Replies owed for work still in progress
+static char move_owed;	// 'f' or 'b' while that move runs, 0 otherwise
+static char scan_owed;	// 1 while a scan runs
+
+// Main loop, in the order the tasks are stepped
+static const char task_command[] PROGMEM = "command";
+static const char task_motion[] PROGMEM = "motion";
+static const char task_sonar[] PROGMEM = "sonar";
+static const char task_scan[] PROGMEM = "scan";
+static const char task_lcd[] PROGMEM = "lcd";
+static task_t tasks[] = {
+	{ task_command, command_step },
+	{ task_motion, motion_step },
+	{ task_sonar, sonar_step },
+	{ task_scan, scan_step },
+	{ task_lcd, lcd_step },
+};
+
 ///Main function
 /** 
-* Initializes all sensors, external items used, etc. Continually waits for serial input, parses input, and then completes command based on that input
+* Initializes all sensors, external items used, etc. Then runs the tasks, forever
 */
 
 int main(void)
 {
     init_all();
-	
-	unsigned char notes[26]  = {72, 67, 69, 67,  0, 72, 67, 69, 67,  0, 72, 72, 72, 72,  0, 72, 72, 72, 72,  0, 72, 71, 72, 71, 72};
-	unsigned char duration[26]={64, 16, 16, 16, 40, 64, 16, 16, 16, 40, 8,   8, 16, 16, 16, 8,   8, 16, 16, 16, 20, 20, 32, 20, 96};
-	
-	int error = 0;
-	char msg[180];
-	char command[10];
-	int magnitude = 0;
-	int j = 0;
-	int averages = 1;
 	beep();
 	
 	
@@ -45,128 +59,257 @@ int main(void)
 		wait_ms(200);
 		pingdist = ping_read();
 		irdist = ir_read(2);
-		lprintf("PING: %d\nIR  : %d\nAVE : %d",pingdist,irdist,(pingdist+irdist)/2);
+		lprintf_P(PSTR("PING: %d\nIR  : %d\nAVE : %d"),pingdist,irdist,(pingdist+irdist)/2);
 	}*/
 	
-	while(1){
-		
-		//lprintf("Awaiting commands");
-		error = 0;
-		j = 0;
-		
-		//Wait for a new line from the serial port
-		serial_getline();
-		beep();
-		
-		//Check commands
-		switch (rcv[0]){
-			case 'a':
-				//Connect acknowledgement
-				serial_putc('a');
-				lprintf("********************\nRover Connected!\n********************");
-				break;
-			case 'f':
-				//Forward with a three digit argument
-				command[0] = rcv[1];
-				command[1] = rcv[2];
-				command[2] = rcv[3];
-				command[3] = '\0';
-				//Convert ASCII to an integer
-				magnitude = atoi(command);
-				//Move forward, returning error data from the sensors
-				error = forward(magnitude);
-				lprintf("Forward");
-				//Return the error to the host
-				serial_putc((char)error);
-				break;			
-			case 'b':
-				//Backward with a three digit argument - ignores sensor data
-				command[0] = rcv[1];
-				command[1] = rcv[2];
-				command[2] = rcv[3];
-				command[3] = '\0';
-				//Convert ASCII to integer
-				magnitude = atoi(command);
-				//Move backwards, return a complete ack
-				error = reverse(magnitude);
-				lprintf("Backward");
-				//Send ack
-				serial_putc((char)error);
-				break;
-			case 'r':
-				//Move right by a three digit argument
-				command[0] = rcv[1];
-				command[1] = rcv[2];
-				command[2] = rcv[3];
-				command[3] = '\0';
-				magnitude = atoi(command);
-				lprintf("Rotate Right: %d",magnitude	);
-				rotate(magnitude,1);
-				break;
-			case 'l':
-				//Move left by a three digit argument
-				command[0] = rcv[1];
-				command[1] = rcv[2];
-				command[2] = rcv[3];
-				command[3] = '\0';
-				magnitude = atoi(command);  
-				lprintf("Rotate Left: %d",magnitude);
-				rotate(magnitude,-1);
-				break;	
-			case 's':
-				//Scan, return objects (within the scan function)
-				command [0] = rcv[1];
-				command [1] = '\0';
-				//Take in an arg to determine how many averages per degree the scanner uses
-				averages = atoi(command);
-				lprintf("Scanning\n%d Averages", averages);
-				//Scan
-				scan(averages);
-				beep();
-				break;	
-			case 'i':
-				//Fast scan, only uses the IR sensor
-				lprintf("Scanning fast");
-				scanfast();
-				beep();
+	sched_run(tasks, sizeof(tasks) / sizeof(tasks[0]));
+	return 0;
+}
+
+/// Send the reply owed for a forward or backward move
+/**
+* Stops the move first if it is still running, in which case the error is MOTION_STOPPED
+*/
+static void move_reply(void)
+{
+	int error;
+	
+	if (!move_owed) {
+		return;
+	}
+	motion_stop();
+	error = motion_result();
+	lprintf_P(move_owed == 'f' ? PSTR("Forward") : PSTR("Backward"));
+	//Return the error to the host
+	serial_putc((char)error);
+	move_owed = 0;
+	
+	if(error){
+		//Print error, make a noise if there is an error
+		lprintf_P(PSTR("Error #: %d"), error);
+		errorsound();
+	}
+}
+
+/// Send the per task runtime counters
+/**
+* One p<name>r<steps>t<milliseconds>q record per task, then m<free>w<low water>q with
+* the SRAM between the static data and the stack now and at its lowest, then a z
+*/
+static void send_profile(void)
+{
+	char str[40];
+	unsigned char i;
+	
+	for (i = 0; i < sizeof(tasks) / sizeof(tasks[0]); i++) {
+		serial_putc('p');
+		serial_putstr_P(tasks[i].name);
+		sprintf_P(str, PSTR("r%lut%luq"), tasks[i].runs, tasks[i].ticks / SCHED_TICKS_PER_MS);
+		serial_putstr(str);
+	}
+	sprintf_P(str, PSTR("m%uw%uq"), sram_free(), sram_low());
+	serial_putstr(str);
+	serial_putc('z');
+}
+
+/// Carry out a received command line
+static void command_run(void)
+{
+	char command[10];
+	char msg[20];
+	int magnitude = 0;
+	int averages = 1;
+	int end;
+	int i;
+	
+	beep();
+	
+	//Check commands
+	switch (rcv[0]){
+		case 'a':
+			//Connect acknowledgement
+			serial_putc('a');
+			lprintf_P(PSTR("********************\nRover Connected!\n********************"));
+			break;
+		case 'f':
+		case 'b':
+			//Forward with a three digit argument, or backward ignoring the sensor data
+			command[0] = rcv[1];
+			command[1] = rcv[2];
+			command[2] = rcv[3];
+			command[3] = '\0';
+			//Convert ASCII to an integer
+			magnitude = atoi(command);
+			//A move still running is cut short and answered first
+			move_reply();
+			motion_start(rcv[0], magnitude);
+			//The error goes to the host once the move is done
+			move_owed = rcv[0];
+			break;
+		case 'r':
+		case 'l':
+			//Rotate right or left by a three digit argument
+			command[0] = rcv[1];
+			command[1] = rcv[2];
+			command[2] = rcv[3];
+			command[3] = '\0';
+			magnitude = atoi(command);
+			lprintf_P(rcv[0] == 'r' ? PSTR("Rotate Right: %d") : PSTR("Rotate Left: %d"), magnitude);
+			move_reply();
+			motion_start(rcv[0], magnitude);
+			break;
+		case 'x':
+			//Stop whatever is moving or scanning
+			move_reply();
+			motion_stop();
+			scan_stop();
+			scan_owed = 0;
+			lprintf_P(PSTR("Stopped"));
+			break;
+		case 's':
+			//Scan, return objects (sent by the scan task)
+			command [0] = rcv[1];
+			command [1] = '\0';
+			//Take in an arg to determine how many averages per degree the scanner uses
+			averages = atoi(command);
+			//Unless followed by f, answered from the last sweep if the rover has not moved
+			if (rcv[2] != 'f' && scan_from_cache(averages, 0)) {
+				lprintf_P(PSTR("Scan from cache"));
+			} else {
+				lprintf_P(PSTR("Scanning\n%d Averages"), averages);
+				scan_stop();
+				scan_start(averages, 0);
+			}
+			scan_owed = 1;
+			break;	
+		case 'v':
+			//Coarse IR sweep, then ping and IR only where something is near
+			command [0] = rcv[1];
+			command [1] = '\0';
+			averages = atoi(command);
+			lprintf_P(PSTR("Scanning coarse\n%d Averages"), averages);
+			scan_stop();
+			scan_start_adaptive(averages);
+			scan_owed = 1;
+			break;
+		case 'w':
+			//Sector scan: three digit start and end angles, one digit step and averages
+			memcpy(command, rcv + 1, 3);
+			command[3] = '\0';
+			magnitude = atoi(command);
+			memcpy(command, rcv + 4, 3);
+			end = atoi(command);
+			scan_stop();
+			//A bad sector, or one not spelled in eight digits, gets an empty answer
+			for (i = 1; i < 9 && isdigit(rcv[i]); i++);
+			if (i < 9 || !scan_start_sector(magnitude, end, rcv[7] - '0', rcv[8] - '0')) {
+				lprintf_P(PSTR("Bad sector"));
+				scan_answer_empty();
+				errorsound();
 				break;
-			case 'm':
-				//Music, for completion of the landing spot
-				playsong(notes, duration);
-				//dodonuts();
-				break;	
-		}
-		
-		if(error){
-			//Print error, make a noise if there is an error
-			sprintf(msg,"Error #: %d", error);
-			lprintf(msg);
-			errorsound();
-		}	
-		
-		//Reset the rcv string to be all 0's
-		for(int i = 0; i < strlen(rcv); i++){
-			rcv[i] = 0;
-		}	
+			}
+			lprintf_P(PSTR("Scanning %d-%d"), magnitude, end);
+			scan_owed = 1;
+			break;
+		case 'n':
+			//Scan taking up to a digit's samples per degree, fewer where they agree
+			command [0] = rcv[1];
+			command [1] = '\0';
+			averages = atoi(command);
+			lprintf_P(PSTR("Scanning\nUp to %d samples"), averages);
+			scan_stop();
+			scan_start_sequential(averages);
+			scan_owed = 1;
+			break;
+		case 'g':
+			//Continuous sweep, sampling while the servo moves
+			lprintf_P(PSTR("Scanning\nContinuous"));
+			scan_stop();
+			scan_start_glide();
+			scan_owed = 1;
+			break;
+		case 'h':
+			//Watch: sweep until stopped, a digit's averages per degree or 0 for continuous sweeps
+			command [0] = rcv[1];
+			command [1] = '\0';
+			averages = atoi(command);
+			lprintf_P(PSTR("Watching\n%d Averages"), averages);
+			scan_stop();
+			scan_start_watch(averages);
+			scan_owed = 1;
+			break;
+		case 'k':
+			//Per degree filter for the scans: 0 mean, 1 median, 2 trimmed mean, 3 Hampel
+			if (scan_set_filter(rcv[1] - '0')) {
+				lprintf_P(PSTR("Filter %c"), rcv[1]);
+			} else {
+				errorsound();
+			}
+			break;
+		case 'i':
+			//Fast scan, only uses the IR sensor; from the last sweep as for s
+			if (rcv[1] != 'f' && scan_from_cache(1, 1)) {
+				lprintf_P(PSTR("Scan from cache"));
+			} else {
+				lprintf_P(PSTR("Scanning fast"));
+				scan_stop();
+				scan_start(1, 1);
+			}
+			scan_owed = 1;
+			break;
+		case 'm':
+			//Music, for completion of the landing spot
+			playsong();
+			//dodonuts();
+			break;	
+		case 't':
+			//Serial throughput test with a three digit byte count
+			command[0] = rcv[1];
+			command[1] = rcv[2];
+			command[2] = rcv[3];
+			command[3] = '\0';
+			magnitude = atoi(command);
+			lprintf_P(PSTR("Throughput: %d"), magnitude);
+			serial_throughput(magnitude);
+			break;
+		case 'p':
+			//Task runtime counters
+			send_profile();
+			break;
+		case 'c':
+			//Raw IR reading for calibration (tools/ircal), 12 bit
+			sprintf_P(msg, PSTR("c%uq"), adc_recent(2, 0));
+			serial_putstr(msg);
+			break;
 	}
 }
 
-/// Receive a line of command via the serial port
+/// Command task
 /**
-* Waits for new line or ten characters to be entered 
+* Collects serial input into rcv until a carriage return or ten characters, then runs the
+* command. Replies owed for moves and scans are sent here once they are done.
 */
-void serial_getline(){
+void command_step(void)
+{
+	char c;
 	
-	//String index initialization
-	int j = 0;
+	if (move_owed && !motion_busy()) {
+		move_reply();
+	}
+	if (scan_owed && !scan_busy()) {
+		beep();
+		scan_owed = 0;
+	}
 	
-	//Wait until the previous character is a new line, or 10 chars have been received
-	while((rcv[j-1] != 13) && (j<10)){
-		
-		//Write to rcv string
-		rcv[j] = serial_getc();
-		j++;
+	while (serial_get(&c)) {
+		rcv[rcv_len++] = c;
+		if (c == 13 || rcv_len == 10) {
+			rcv[rcv_len] = 0;
+			rcv_len = 0;
+			command_run();
+			//Reset the rcv string to be all 0's
+			memset(rcv, 0, sizeof(rcv));
+			return;
+		}
 	}
-	//Write null character to final bit of rcv string
-	rcv[j] = 0;
 }
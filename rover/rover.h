@@ -16,13 +16,14 @@
 	
 ///Main function
 /** 
-* Initializes all sensors, external items used, etc. Continually waits for serial input, parses input, and then completes command based on that input
+* Initializes all sensors, external items used, etc. Then runs the tasks, forever
 */
 
 int main(void);
 
-/// Receive a line of command via the serial port
+/// Command task
 /**
-* Waits for new line or ten characters to be entered 
+* Collects serial input until a carriage return or ten characters, then runs the command.
+* Replies owed for moves and scans are sent once they are done.
 */
-void serial_getline();
+void command_step(void);
@@ -0,0 +1,150 @@
+/**
+ * sched.c: cooperative run-to-completion task scheduler, system clock and software timers
+ *
+ * The timers sit in a wheel of SCHED_WHEEL_SLOTS lists, hashed on the millisecond they
+ * are due in.  Each millisecond only its slot is walked, and a timer further out than one
+ * turn of the wheel stays in its slot until the turn it is due in.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include "sched.h"
+
+static volatile uint32_t sched_ms;		// milliseconds since sched_init()
+static uint32_t wheel_ms;				// last millisecond the wheel has been run for
+static sched_timer_t *wheel[SCHED_WHEEL_SLOTS];
+
+/// Start the system tick on timer 2 and enable interrupts
+void sched_init(void) {
+	OCR2 = SCHED_TICKS_PER_MS - 1;	// CTC counts 0 to OCR2, so 250 counts = 1 ms
+	TCCR2 = 0b00001011;				// WGM:CTC, COM:OC2 disconnected, prescaler = 64
+	TIMSK |= 0b10000000;			// Enabling O.C. Interrupt for Timer2
+	sei();
+}
+
+/// Timer 2 compare match, once a millisecond
+ISR (TIMER2_COMP_vect) {
+	sched_ms++;
+}
+
+/// Milliseconds since sched_init()
+uint32_t sched_millis(void) {
+	uint8_t sreg = SREG;
+	uint32_t ms;
+
+	cli();
+	ms = sched_ms;
+	SREG = sreg;
+	return ms;
+}
+
+/// Time since sched_init() in 4 us ticks
+uint32_t sched_ticks(void) {
+	uint8_t sreg = SREG;
+	uint32_t ms;
+	uint8_t count;
+
+	cli();
+	ms = sched_ms;
+	count = TCNT2;
+	// The compare match has happened but the interrupt has not been taken yet
+	if (TIFR & _BV(OCF2)) {
+		ms++;
+		count = TCNT2;
+	}
+	SREG = sreg;
+	// The match sets the flag as the counter reaches OCR2, a count before it clears, so
+	// the millisecond starts at OCR2 and the other counts are one further into it
+	if (count == SCHED_TICKS_PER_MS - 1)
+		count = 0;
+	else
+		count++;
+	return ms * SCHED_TICKS_PER_MS + count;
+}
+
+/// Step the tasks in turn, forever, firing software timers as they come due
+void sched_run(task_t *tasks, unsigned char count) {
+	unsigned char i;
+	uint32_t start;
+
+	while (1) {
+		sched_timers_run();
+		for (i = 0; i < count; i++) {
+			start = sched_ticks();
+			tasks[i].step();
+			tasks[i].ticks += sched_ticks() - start;
+			tasks[i].runs++;
+		}
+	}
+}
+
+/// Deadline a number of milliseconds from now, for sched_expired()
+uint32_t sched_deadline(unsigned long ms) {
+	return sched_ticks() + ms * SCHED_TICKS_PER_MS;
+}
+
+/// Whether a deadline from sched_deadline() has passed
+char sched_expired(uint32_t deadline) {
+	return (int32_t) (sched_ticks() - deadline) >= 0;
+}
+
+/// Call fire once ms milliseconds have passed
+void sched_timer_start(sched_timer_t *timer, unsigned long ms, void (*fire)(void)) {
+	uint32_t due = sched_millis() + ms;
+	sched_timer_t **slot;
+
+	sched_timer_stop(timer);
+	// The wheel may be behind the clock; never file a timer in a slot already passed
+	if ((int32_t) (due - wheel_ms) <= 0)
+		due = wheel_ms + 1;
+	slot = &wheel[due % SCHED_WHEEL_SLOTS];
+	timer->due = due;
+	timer->fire = fire;
+	timer->next = *slot;
+	*slot = timer;
+}
+
+/// Stop a timer without calling it back
+void sched_timer_stop(sched_timer_t *timer) {
+	sched_timer_t **link;
+
+	if (!timer->fire)
+		return;
+	for (link = &wheel[timer->due % SCHED_WHEEL_SLOTS]; *link; link = &(*link)->next) {
+		if (*link == timer) {
+			*link = timer->next;
+			break;
+		}
+	}
+	timer->fire = 0;
+}
+
+/// Whether a timer is running
+char sched_timer_pending(sched_timer_t *timer) {
+	return timer->fire != 0;
+}
+
+/// Fire the software timers that have come due
+void sched_timers_run(void) {
+	uint32_t now = sched_millis();
+	sched_timer_t **slot, **link, *timer;
+	void (*fire)(void);
+
+	while (wheel_ms != now) {
+		wheel_ms++;
+		slot = &wheel[wheel_ms % SCHED_WHEEL_SLOTS];
+		link = slot;
+		while ((timer = *link)) {
+			if (timer->due != wheel_ms) {
+				link = &timer->next;
+				continue;
+			}
+			*link = timer->next;
+			fire = timer->fire;
+			timer->fire = 0;
+			fire();
+			// The callback may have started or stopped timers in this slot
+			link = slot;
+		}
+	}
+}
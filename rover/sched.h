@@ -0,0 +1,88 @@
+/**
+ * sched.h: cooperative run-to-completion task scheduler, system clock and software timers
+ *
+ * Every task is a state machine with a step function that does a small piece of work and
+ * returns.  sched_run() steps each task in turn, forever, and keeps a runtime counter per
+ * task so it is visible where the time goes.
+ *
+ * Timer 2 is the system tick: it runs free from sched_init() on, interrupting every
+ * millisecond, and nothing else reprograms it.  Between interrupts its count gives the
+ * time to 4 us.  Deadlines are polled with sched_deadline()/sched_expired(); a software
+ * timer calls back once its time is up, from sched_run() rather than the interrupt.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include <stdint.h>
+#include <avr/interrupt.h>
+
+/// Timer 2 counts per millisecond (16 MHz / 64)
+#define SCHED_TICKS_PER_MS 250
+
+/// Number of slots in the software timer wheel, a power of two
+#define SCHED_WHEEL_SLOTS 16
+
+/// One task of the main loop
+typedef struct {
+	const char *name;		///< in program memory (PROGMEM)
+	void (*step)(void);		///< does a little work and returns; must not block for long
+	unsigned long runs;		///< number of steps taken
+	unsigned long ticks;	///< time spent in the step, in 4 us ticks
+} task_t;
+
+/// Software timer, owned by the module that starts it
+typedef struct sched_timer {
+	struct sched_timer *next;
+	uint32_t due;			///< millisecond it fires in
+	void (*fire)(void);
+} sched_timer_t;
+
+/// Start the system tick on timer 2 and enable interrupts
+void sched_init(void);
+
+/// Timer 2 compare match, once a millisecond
+ISR (TIMER2_COMP_vect);
+
+/// Milliseconds since sched_init()
+uint32_t sched_millis(void);
+
+/// Time since sched_init() in 4 us ticks; wraps after about 4.7 hours
+uint32_t sched_ticks(void);
+
+/// Step the tasks in turn, forever, firing software timers as they come due
+/**
+* @param tasks the tasks, stepped in this order
+* @param count number of tasks
+*/
+void sched_run(task_t *tasks, unsigned char count);
+
+/// Deadline a number of milliseconds from now, for sched_expired()
+/**
+* @param ms milliseconds from now, less than 2^31 ticks (about 2.3 hours)
+* @return deadline in 4 us ticks
+*/
+uint32_t sched_deadline(unsigned long ms);
+
+/// Whether a deadline from sched_deadline() has passed
+char sched_expired(uint32_t deadline);
+
+/// Call fire once ms milliseconds have passed
+/**
+* Restarts the timer if it is already running
+* @param timer the timer, which must stay valid until it fires or is stopped
+* @param ms milliseconds from now
+* @param fire called from sched_run() or sched_timers_run()
+*/
+void sched_timer_start(sched_timer_t *timer, unsigned long ms, void (*fire)(void));
+
+/// Stop a timer without calling it back; nothing happens if it is not running
+void sched_timer_stop(sched_timer_t *timer);
+
+/// Whether a timer is running
+char sched_timer_pending(sched_timer_t *timer);
+
+/// Fire the software timers that have come due; sched_run() calls this every pass
+void sched_timers_run(void);
+
+#endif
@@ -0,0 +1,139 @@
+/**
+ * ircal.c: IR ranger calibration, emits the firmware's distance table
+ *
+ * Reads (ADC, distance) pairs logged against the sensor and fits the Sharp ranger's
+ * response, distance = a / (adc + b) + c, by least squares: for each b on a grid, a and
+ * c follow from a straight line fit in 1 / (adc + b), and the b with the smallest error
+ * wins.  The fit is then written out as a C file holding ir_table_mm[], the distance in
+ * mm for each of the 1024 ADC values, in PROGMEM.
+ *
+ *   ircal [-m max_cm] [calibration file] > ir_table.c
+ *
+ * Each line of the calibration file is "<adc> <cm>", adc on the 10 bit scale (the 12 bit
+ * value from the rover's c command divided by 4); # starts a comment.  Distances beyond
+ * max_cm (default 200), and ADC values past the fitted curve's asymptote, are clamped
+ * to max_cm; distances the curve puts below 0 are clamped to 0.  The fit and the residual of every point go to standard error.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define MAX_POINTS 1024
+#define TABLE_SIZE 1024
+
+static double adc[MAX_POINTS], cm[MAX_POINTS];
+static int count;
+
+/// Least squares a and c for a given b; returns the sum of squared errors in cm
+static double fit(double b, double *a, double *c) {
+	double sf = 0, sff = 0, sy = 0, sfy = 0, f, det, e, err = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (adc[i] + b <= 0)
+			return HUGE_VAL;
+		f = 1 / (adc[i] + b);
+		sf += f;
+		sff += f * f;
+		sy += cm[i];
+		sfy += f * cm[i];
+	}
+	det = count * sff - sf * sf;
+	if (det == 0)
+		return HUGE_VAL;
+	*a = (count * sfy - sf * sy) / det;
+	*c = (sy - *a * sf) / count;
+	for (i = 0; i < count; i++) {
+		e = *a / (adc[i] + b) + *c - cm[i];
+		err += e * e;
+	}
+	return err;
+}
+
+static void load(FILE *f) {
+	char line[128];
+	double x, y;
+
+	while (fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "#")] = 0;
+		if (sscanf(line, "%lf %lf", &x, &y) != 2)
+			continue;
+		if (count == MAX_POINTS) {
+			fprintf(stderr, "ircal: more than %d points\n", MAX_POINTS);
+			exit(1);
+		}
+		adc[count] = x;
+		cm[count++] = y;
+	}
+}
+
+int main(int argc, char **argv) {
+	double max_cm = 200, a = 0, b = 0, c = 0, err, best = HUGE_VAL, ta, tc, tb, d, low = 0;
+	FILE *f = stdin;
+	int i, n;
+
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-m") && i + 1 < argc)
+			max_cm = atof(argv[++i]);
+		else if (!(f = fopen(argv[i], "r"))) {
+			perror(argv[i]);
+			return 1;
+		}
+	}
+	load(f);
+	if (count < 3) {
+		fprintf(stderr, "ircal: need at least 3 points, got %d\n", count);
+		return 1;
+	}
+
+	// b must keep adc + b positive for every point; search well past the ADC range
+	for (i = 0; i < count; i++)
+		if (i == 0 || adc[i] < low)
+			low = adc[i];
+	for (tb = -low + 0.5; tb < 4096; tb += 0.5) {
+		err = fit(tb, &ta, &tc);
+		if (err < best) {
+			best = err;
+			a = ta;
+			b = tb;
+			c = tc;
+		}
+	}
+	if (best == HUGE_VAL || a <= 0) {
+		fprintf(stderr, "ircal: no falling curve fits these points\n");
+		return 1;
+	}
+
+	fprintf(stderr, "ircal: %d points, distance = %.2f / (adc %c %.1f) + %.3f, rms error %.2f cm\n",
+	        count, a, b < 0 ? '-' : '+', fabs(b), c, sqrt(best / count));
+	for (i = 0; i < count; i++)
+		fprintf(stderr, "  adc %7.2f  %6.1f cm  fit %6.1f cm\n", adc[i], cm[i], a / (adc[i] + b) + c);
+
+	printf("/**\n");
+	printf(" * ir_table.c: IR ranger distance for each ADC value, generated by tools/ircal\n");
+	printf(" *\n");
+	printf(" * distance = %.2f / (adc %c %.1f) + %.3f cm, fitted to %d points (rms %.2f cm),\n",
+	       a, b < 0 ? '-' : '+', fabs(b), c, count, sqrt(best / count));
+	printf(" * clamped to %.0f cm.  Regenerate with make ir_table rather than editing.\n", max_cm);
+	printf(" */\n\n");
+	printf("#include <avr/pgmspace.h>\n");
+	printf("#include \"util.h\"\n\n");
+	printf("/// Distance in mm for each 10 bit ADC value\n");
+	printf("const uint16_t ir_table_mm[%d] PROGMEM = {", TABLE_SIZE);
+	for (n = 0; n < TABLE_SIZE; n++) {
+		d = n + b > 0 ? a / (n + b) + c : max_cm;
+		if (d > max_cm)
+			d = max_cm;
+		if (d < 0)
+			d = 0;
+		printf("%s%5ld,", n % 12 ? " " : "\n\t", lround(d * 10));
+	}
+	printf("\n};\n");
+	if (fflush(stdout) || ferror(stdout)) {
+		perror("ircal");
+		return 1;
+	}
+	return 0;
+}
@@ -8,66 +8,38 @@
 #include <avr/io.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 #include <avr/interrupt.h>
+#include "hal.h"
 #include "util.h"
 #include "open_interface.h"
 #include "lcd.h"
+#include "sched.h"
 
-// Global used for interrupt driven delay functions
-volatile unsigned int timer2_tick;
-void timer2_start(char unit);
-void timer2_stop();
+// The Create, set up once by init_all() and kept up to date by the sensor stream
+oi_t create;
+
+// Songs kept on the Create; the victory tune is longer than the 16 notes a slot holds
+static const unsigned char victory_notes[26] PROGMEM    = {72, 67, 69, 67,  0, 72, 67, 69, 67,  0, 72, 72, 72, 72,  0, 72, 72, 72, 72,  0, 72, 71, 72, 71, 72};
+static const unsigned char victory_duration[26] PROGMEM = {64, 16, 16, 16, 40, 64, 16, 16, 16, 40, 8,   8, 16, 16, 16, 8,   8, 16, 16, 16, 20, 20, 32, 20, 96};
+static const unsigned char beep_note[1] PROGMEM = {70};
+static const unsigned char beep_duration[1] PROGMEM = {5};
+static const unsigned char error_notes[3] PROGMEM = {63,72,81};
+static const unsigned char error_duration[3] PROGMEM = {5,5,5};
 
 
 /// Blocks for a specified number of milliseconds
 /**
-* Uses a prescaled timer to calculate milliseconds
+* Waits on the system clock, so timer 2 keeps running for everything else
 * @param time_val an integer representing how many milliseconds to wait
 */
 void wait_ms(unsigned int time_val) {
-	//Seting OC value for time requested
-	OCR2=250; 				//Clock is 16 MHz. At a prescaler of 64, 250 timer ticks = 1ms.
-	timer2_tick=0;
-	timer2_start(0);
+	uint32_t end = sched_deadline(time_val);
 
 	//Waiting for time
-	while(timer2_tick < time_val);
-
-	timer2_stop();
-}
-
-/// Start timer2
-/**
-* Initializes timer2, used for the wait_ms function
-* @param unit 0 for slow, 1 for fast
-*/
-void timer2_start(char unit){
-	timer2_tick=0;
-	if ( unit == 0 ) { 		//unit = 0 is for slow 
-        TCCR2=0b00001011;	//WGM:CTC, COM:OC2 disconnected,pre_scaler = 64
-        TIMSK|=0b10000000;	//Enabling O.C. Interrupt for Timer2
-	}		
-	if (unit == 1){ 		//unit = 1 is for fast
-        TCCR2=0b00001001;	//WGM:CTC, COM:OC2 disconnected,pre_scaler = 1
-        TIMSK|=0b10000000;	//Enabling O.C. Interrupt for Timer2
-		}
-	sei();
-}
-
-/// Stop timer2
-void timer2_stop() {
-	TIMSK&=~0b10000000;		//Disabling O.C. Interrupt for Timer2
-	TCCR2&=0b01111111;		//Clearing O.C. settings
-}
-
-
-/// Interrupt handler
-/**
-* Runs every 1 ms and increments the timer counter
-*/
-ISR (TIMER2_COMP_vect) {
-	timer2_tick++;
+	while (!sched_expired(end))
+		hal_idle();
 }
 
 //Push Buttons and Shaft Encoder
@@ -200,9 +172,9 @@ void  move_stepper_motor_by_step(int num_steps, int direction) {
 
 //Sonar
 
-volatile unsigned rising_time; // start time of the return pulse
-volatile unsigned falling_time; // end time of the return pulse
-volatile int overflow=0; //Overflow Counter
+volatile uint32_t rising_time; // start time of the return pulse
+volatile uint32_t falling_time; // end time of the return pulse
+volatile unsigned int overflow=0; //Overflow Counter, the upper 16 bits of the timer 1 time
 volatile int state; //Ping state - 0 is LOW, 1 is HIGH, 2 is DONE
 
 ///Timer 1 Overflow Counter
@@ -212,6 +184,18 @@ ISR (TIMER1_OVF_vect)
 	overflow++;
 }
 
+///Captured time extended to 32 bits with the overflow count, for the capture interrupt
+static uint32_t capture_time(void)
+{
+	unsigned int low = ICR1;
+	unsigned int high = overflow;
+	//An overflow not yet counted came before the capture if the capture is from after the wrap
+	if ((TIFR & _BV(TOV1)) && low < 0x8000) {
+		high++;
+	}
+	return ((uint32_t)high << 16) | low;
+}
+
 ///Timer 1 captures a rising edge
 ISR (TIMER1_CAPT_vect)
 {
@@ -219,13 +203,13 @@ ISR (TIMER1_CAPT_vect)
 	//If in high state, set to done
 	switch (state) {
 		case 0:
-		rising_time = ICR1; // save captured time
+		rising_time = capture_time(); // save captured time
 		TCCR1B &= ~_BV(ICES); // to detect falling edge
 		state = 1; // now in HIGH state
 		break;
 
 		case 1:
-		falling_time = ICR1; // save captured time
+		falling_time = capture_time(); // save captured time
 		TCCR1B |= _BV(ICES); // to detect falling edge
 		state = 2; // now its DONE
 		break;
@@ -241,8 +225,8 @@ ISR (TIMER1_CAPT_vect)
 void sonar_init()
 {
 	// enable Timer1 and interrupt
-	// Set TCCR1B: Rising Edge sets trigger, Noice Canceller, no Waveform Generator, prescalar 1024 (CS=101)
-	TCCR1B = 0b11000101;
+	// Set TCCR1B: Rising Edge sets trigger, Noice Canceller, no Waveform Generator, prescalar 8 (CS=010), 0.5 us a tick
+	TCCR1B = 0b11000010;
 	//Enable Input Catpure Interrupt, and Overflow Interrupt
 	TIMSK |= 0b00100100;
 	//Initialize State to LOW
@@ -265,28 +249,153 @@ void pulse()
 
 ///Distance Calculator
 /**
-* Calculates distance from time (34,000 cm/seconds = 34 cm/ microsecond, divided by 16 because the prescalar of 1024 causes the timer to increment every 1/15625 of a second
-* We're trying to get microseconds, so divide that 15625 by 1000, so the timer increments every 1/15.6 of a microsecond, which is close to 16, so divide by 16. For some unexplained reason, I had to divide by 2 to get calibration correct.
-* @param time Time in an integer value from the ping sensor (from rising edge to falling edge) - represents timer ticks
-* @return distance in centimeters
+* Sound covers 0.343 mm a microsecond and the echo goes out and back, so each 0.5 us
+* timer tick is 0.08575 mm of range, kept as SONAR_MM_PER_TICK_Q16 / 65536
+* @param time timer ticks from rising edge to falling edge of the echo
+* @return distance in millimeters
+*/
+unsigned distancecalc_mm(uint32_t time)
+{
+	return (time * SONAR_MM_PER_TICK_Q16 + 0x8000) >> 16;
+}
+
+///Distance Calculator
+/**
+* @param time timer ticks from rising edge to falling edge of the echo
+* @return distance in centimeters, rounded
 */
-unsigned distancecalc(int time)
+unsigned distancecalc(uint32_t time)
+{
+	return (distancecalc_mm(time) + 5) / 10;
+}
+
+// Measurement in progress, stepped by sonar_step()
+#define SONAR_DONE 0
+#define SONAR_HOLDOFF 1
+#define SONAR_TRIGGER 2
+#define SONAR_ECHO 3
+static char sonar_phase;
+static char sonar_echo; // the last measurement got its echo
+static uint32_t sonar_mark; // when the trigger went up, or the last measurement ended
+static sched_timer_t sonar_watchdog;
+
+///Raise the trigger; state 2 keeps the capture interrupt off our own edges
+static void sonar_trigger(void)
+{
+	state = 2;
+	DDRD	|=	0x10; // set PD4 as output
+	PORTD	&=	~0x10; // set PD4 to low
+	PORTD	|=	0x10; // set PD4 to high
+	sonar_mark = sched_ticks();
+	sonar_phase = SONAR_TRIGGER;
+}
+
+///No echo within SONAR_TIMEOUT_MS; give up on it so the sonar is free again
+static void sonar_timeout(void)
 {
-	return (time*34/32);
+	state = 2;
+	TCCR1B |= _BV(ICES); // back to the rising edge for the next echo
+	sonar_echo = 0;
+	sonar_mark = sched_ticks();
+	sonar_phase = SONAR_DONE;
 }
 
 ///Send a ping and return distance
 /**
-* Sends a pules, set to low state, wait for done state (handled in the pulse and timer interrupt routines)
-* @return distance in centimeters
+* Runs a measurement through the sonar engine and waits for it to finish
+* @return distance in centimeters, or SONAR_NO_ECHO
 */
 
 unsigned ping_read()
 {
-	pulse(); // send the starting pulse to PING
-	state = 0; // now in the LOW state
-	while (state != 2){} // wait until IC is done
-	return distancecalc(falling_time - rising_time); // calculate and return distance
+	sonar_start();
+	while (sonar_busy()){ // wait until IC is done or the watchdog gives up
+		sonar_step();
+		sched_timers_run();
+		hal_idle();
+	}
+	return sonar_distance();
+}
+
+///Start a sonar measurement without waiting for it
+/**
+* Returns at once; sonar_step() raises and ends the trigger, the capture interrupt times the
+* echo and a watchdog gives up on it after SONAR_TIMEOUT_MS. Does nothing while a
+* measurement is running.
+*/
+void sonar_start(void)
+{
+	if (sonar_busy()) {
+		return;
+	}
+	sonar_echo = 0;
+	sonar_phase = SONAR_HOLDOFF;
+	sonar_step();
+}
+
+///Sonar task
+/**
+* Waits out the quiet time the sensor needs after an echo, holds the trigger up for at
+* least SONAR_TRIGGER_TICKS, then waits for the echo
+*/
+void sonar_step(void)
+{
+	switch (sonar_phase) {
+		case SONAR_HOLDOFF:
+			if (sched_ticks() - sonar_mark >= SONAR_HOLDOFF_TICKS) {
+				sonar_trigger();
+			}
+			break;
+		case SONAR_TRIGGER:
+			if (sched_ticks() - sonar_mark < SONAR_TRIGGER_TICKS) {
+				break;
+			}
+			PORTD	&=	~0x10; // set PD4 to low
+			DDRD	&=	~0x10; // set PD4 as input
+			TCCR1B |= _BV(ICES); // to detect rising edge
+			state = 0; // now in the LOW state
+			sched_timer_start(&sonar_watchdog, SONAR_TIMEOUT_MS, sonar_timeout);
+			sonar_phase = SONAR_ECHO;
+			break;
+		case SONAR_ECHO:
+			if (state == 2) {
+				sched_timer_stop(&sonar_watchdog);
+				sonar_echo = 1;
+				sonar_mark = sched_ticks();
+				sonar_phase = SONAR_DONE;
+			}
+			break;
+	}
+}
+
+///Whether the measurement from sonar_start() is still running
+char sonar_busy(void)
+{
+	return sonar_phase != SONAR_DONE;
+}
+
+///Distance from the last finished measurement
+/**
+* @return distance in centimeters, or SONAR_NO_ECHO if the echo never came
+*/
+unsigned sonar_distance(void)
+{
+	if (!sonar_echo) {
+		return SONAR_NO_ECHO;
+	}
+	return distancecalc(falling_time - rising_time);
+}
+
+///Distance from the last finished measurement, in millimeters
+/**
+* @return distance in millimeters, or SONAR_NO_ECHO_MM if the echo never came
+*/
+unsigned sonar_distance_mm(void)
+{
+	if (!sonar_echo) {
+		return SONAR_NO_ECHO_MM;
+	}
+	return distancecalc_mm(falling_time - rising_time);
 }
 
 
@@ -295,81 +404,178 @@ unsigned ping_read()
 
 //IR Sensor
 
+// Channels the ADC interrupt samples in turn
+static const unsigned char adc_channels[ADC_CHANNELS] = { 2 };
+
+// Per channel: the sum being built and, once ADC_OVERSAMPLE samples are in, the ring of
+// decimated values it goes to
+static unsigned int adc_sum[ADC_CHANNELS];
+static unsigned char adc_count[ADC_CHANNELS];
+static volatile unsigned int adc_ring[ADC_CHANNELS][ADC_RING_SIZE];
+static volatile unsigned char adc_head[ADC_CHANNELS];	// counts decimated values, wrapping
+static unsigned char adc_current;						// index of the channel converting
+static unsigned char ir_index;							// index of the channel given to ir_start()
+static unsigned char ir_mark;							// its adc_head at ir_start()
+static volatile unsigned char adc_stale;				// conversion under way at ir_start() is dropped
+
+///Index of an ADC channel in adc_channels, ADC_CHANNELS if it is not sampled
+static unsigned char adc_index(char channel)
+{
+	unsigned char i;
+	
+	for (i = 0; i < ADC_CHANNELS && adc_channels[i] != channel; i++)
+		;
+	return i;
+}
+
+///Select a channel, clearing the MUX bits of the previous one
+static void adc_select(unsigned char channel)
+{
+	ADMUX = (ADMUX & ~0x1F) | (channel & 0x1F);
+}
+
 ///Initialize ADC for IR sensor
+/**
+* Starts the background sampler; from here on the ADC interrupt converts the channels in
+* adc_channels in turn
+*/
 void IR_init()
 {
 	// REFS=11, ADLAR=0, MUX dont care
 	ADMUX = _BV(REFS1) | _BV(REFS0);
-	// ADEN=1, ADFR=0, ADIE=0, ADSP=111
+	adc_current = 0;
+	adc_select(adc_channels[0]);
+	// ADEN=1, ADFR=0, ADIE=1, ADSP=111, start the first conversion
 	// others dont care
 	// See page 246 of user guide
-	ADCSRA = _BV(ADEN) | (7<<ADPS0);
+	ADCSRA = _BV(ADEN) | _BV(ADIE) | _BV(ADSC) | (7<<ADPS0);
+}
+
+///Conversion complete
+/**
+* Adds the sample to its channel's sum, moves a finished sum into the channel's ring, then
+* starts the next channel. A single conversion rather than free running mode, so the new
+* channel is the one converted next.
+*/
+ISR (ADC_vect)
+{
+	unsigned char i = adc_current;
+	
+	if (adc_stale) {
+		//Sampled before ir_start() emptied the sum
+		adc_stale = 0;
+	} else if (adc_sum[i] += ADC, ++adc_count[i] == ADC_OVERSAMPLE) {
+		//Sum of 16 samples, kept 2 bits finer than the ADC (12 bits)
+		adc_ring[i][adc_head[i] % ADC_RING_SIZE] = adc_sum[i] >> 2;
+		adc_head[i]++;
+		adc_sum[i] = 0;
+		adc_count[i] = 0;
+	}
+	
+	if (++adc_current == ADC_CHANNELS) {
+		adc_current = 0;
+	}
+	adc_select(adc_channels[adc_current]);
+	ADCSRA |= _BV(ADSC);
 }
 
-///Linear interpolation
+///Decimated value of a sampled channel
 /**
-* Takes in two points and an x value, returns a y value along that line
-* @param x1 float representing the x value of point one on a line
-* @param x2 float representing the x value of point two on a line
-* @param y1 float representing the y value of point one on a line
-* @param y2 float representing the y value of point two on a line
-* @param x float representing the x value that the desired calculated y value is paired with
-* @return float representing the point on the line that the x input corresponds to
+* @param channel ADC channel, one of adc_channels
+* @param age 0 for the latest value, up to ADC_RING_SIZE - 1 for older ones
+* @return 12 bit value (the 10 bit reading times 4), 0 for a channel not sampled
 */
-float line(float x1, float x2, float y1, float y2, float x){
-	float y;
-	float slope = (y2-y1)/(x2-x1);
-	float intercept = y1 - slope*x1;
-	y = (slope*x + intercept);
-	//y = (int)y;
-	return y;
+unsigned adc_recent(char channel, unsigned char age)
+{
+	unsigned char i = adc_index(channel);
+	unsigned char sreg = SREG;
+	unsigned value;
 	
+	if (i == ADC_CHANNELS) {
+		return 0;
+	}
+	cli();
+	value = adc_ring[i][(unsigned char)(adc_head[i] - 1 - age) % ADC_RING_SIZE];
+	SREG = sreg;
+	return value;
 }
 
 ///Distance Calculation from ADC's measured value
 /**
-* Takes in the raw distance from the ADC's 10 bit value, does linear interpolation in five regions and returns the distance in centimeters
+* Looks the raw value up in ir_table_mm, generated by tools/ircal from calibration points
 * @param distance_val the raw distance value from the ADC 
 * @return distance in centimeters
 */
 int distance_lookup(int distance_val){
-	int distance;
-	if (distance_val>710){
-		distance = line(1000,710,10,15,distance_val);
-		return distance;
-	}
-	else if (distance_val>500){
-		distance = line(710,500,15,20,distance_val);
-		return distance;
-	}
-	else if (distance_val>290){
-		distance = line(500,290,20,40,distance_val);
-		return distance;
-	}
-	else if (distance_val>220){
-		distance = line(290,220,40,60,distance_val);
-		return distance;
-	}
-	else{
-		distance = line(220,180,60,80,distance_val);
-		return distance;
-	}
+	return (pgm_read_word(&ir_table_mm[distance_val & 0x3FF]) + 5) / 10;
+}
+
+///Distance from an oversampled ADC value
+/**
+* Looks up the 10 bit part and interpolates between neighbouring entries on the 2 extra bits
+* @param value 12 bit value from adc_recent()
+* @return distance in millimeters
+*/
+unsigned ir_lookup_mm(unsigned value){
+	unsigned i = (value >> 2) & 0x3FF;
+	int low = pgm_read_word(&ir_table_mm[i]);
+	int high = i < 1023 ? pgm_read_word(&ir_table_mm[i + 1]) : low;
+	return low + (high - low) * (int)(value & 3) / 4;
+}
+
+///Ask for a fresh IR value
+/**
+* The sampler runs all the time; this empties the channel's sum and drops the conversion
+* under way, so that the value ir_ready() waits for is made only of samples taken after
+* the call
+* @param channel channel to use for the ADC
+*/
+void ir_start(char channel)
+{
+	unsigned char sreg = SREG;
 	
-};
+	ir_index = adc_index(channel);
+	if (ir_index < ADC_CHANNELS) {
+		cli();
+		adc_sum[ir_index] = 0;
+		adc_count[ir_index] = 0;
+		adc_stale = adc_current == ir_index;
+		ir_mark = adc_head[ir_index];
+		SREG = sreg;
+	}
+}
+
+///Whether a value has been completed since ir_start()
+char ir_ready(void)
+{
+	return ir_index == ADC_CHANNELS || adc_head[ir_index] != ir_mark;
+}
+
+///Scaled value of the latest reading on the channel given to ir_start()
+/**
+* @return distance in centimeters
+*/
+unsigned ir_value(void)
+{
+	return (ir_value_mm() + 5) / 10;
+}
+
+///Latest reading on the channel given to ir_start(), in millimeters
+unsigned ir_value_mm(void)
+{
+	//A channel not sampled reads 0, as from adc_recent()
+	return ir_lookup_mm(ir_index < ADC_CHANNELS ? adc_recent(adc_channels[ir_index], 0) : 0);
+}
 
 ///Read ADC and return its scaled value
 /**
-* Reads ADC
+* Returns at once with the latest decimated value from the background sampler
 * @param channel channel to use for the ADC
 * @return distance in centimeters
 */
 unsigned ir_read(char channel)
 {
-	ADMUX |= (channel & 0x1F);
-	ADCSRA |= _BV(ADSC);
-	while (ADCSRA & _BV(ADSC))
-		{}
-	return distance_lookup(ADC);
+	return (ir_lookup_mm(adc_recent(channel, 0)) + 5) / 10;
 }
 
 
@@ -392,25 +598,178 @@ void servo_init( void )
 	DDRE = 0xFF;			// set Port E pin 4 (OC3B) as output
 }
 
+// Slew model: where the servo is heading, where it came from, and whether it is there
+static unsigned servo_to;
+static unsigned servo_from = SERVO_UNKNOWN;
+static char servo_moving;
+static void (*servo_settled_cb)(void);
+static sched_timer_t servo_timer;
+
+// Sweep model: the command steps a degree every servo_sweep_ms from servo_sweep_tick on
+static unsigned servo_sweep_ms; // 0 when the last move was a plain step
+static uint32_t servo_sweep_tick;
+static unsigned servo_sweep_from;
+static unsigned servo_command; // angle commanded so far in the sweep
+
+///Time until the pulse width just written reaches the servo, in ms
+/**
+* OCR3B is double buffered: the new width goes out with the next frame, and the servo
+* only reads it once that pulse has ended.
+*/
+static unsigned servo_frame_ms(void)
+{
+	return ((unsigned long)(OCR3A - TCNT3) + OCR3B + SERVO_COUNTS_PER_MS - 1) / SERVO_COUNTS_PER_MS;
+}
+
+///Settle timer ran out: the servo has reached servo_to
+static void servo_settled(void)
+{
+	void (*settled)(void) = servo_settled_cb;
+	
+	servo_moving = 0;
+	servo_from = servo_to;
+	servo_settled_cb = 0;
+	if (settled) {
+		settled();
+	}
+}
+
+///Start the servo towards a degree angle
+/**
+* Sets the pulse width and works out from the slew model how long the move takes: the rest
+* of the PWM frame and the new pulse before the servo sees the command, the angular step
+* at SERVO_MS_PER_60, plus SERVO_SETTLE_MS for the horn to come to rest. A
+* move that starts while another is under way is timed from the farther of that move's
+* ends; the first move after power up is timed as a full sweep.
+* @param degree angle in degrees to set the servo to
+* @param settled called once the servo is there, or 0
+*/
+void servo_move_to(unsigned degree, void (*settled)(void))
+{
+	unsigned step;
+	unsigned step_to = degree > servo_to ? degree - servo_to : servo_to - degree;
+	
+	if (servo_from == SERVO_UNKNOWN) {
+		step = 180;
+	} else {
+		step = degree > servo_from ? degree - servo_from : servo_from - degree;
+		if (!servo_moving || step_to > step) {
+			step = step_to;
+		}
+	}
+	
+	OCR3B = servo_degree_calc(degree); // set pulse width
+	servo_sweep_ms = 0;
+	if (!servo_moving) {
+		servo_from = servo_from == SERVO_UNKNOWN ? SERVO_UNKNOWN : servo_to;
+	}
+	servo_to = degree;
+	servo_moving = 1;
+	servo_settled_cb = settled;
+	sched_timer_start(&servo_timer, servo_frame_ms() + SERVO_SETTLE_MS + ((unsigned long)step * SERVO_MS_PER_60 + 59) / 60, servo_settled);
+}
+
+///Sweep timer: command the next degree, or wait for the last one to settle
+static void servo_sweep_step(void)
+{
+	servo_command += servo_command < servo_to ? 1 : -1;
+	OCR3B = servo_degree_calc(servo_command);
+	if (servo_command != servo_to) {
+		sched_timer_start(&servo_timer, servo_sweep_ms, servo_sweep_step);
+	} else {
+		sched_timer_start(&servo_timer, servo_frame_ms() + SERVO_SETTLE_MS + (SERVO_MS_PER_60 + 59) / 60, servo_settled);
+	}
+}
+
+///Sweep the servo to a degree angle at a steady rate
+/**
+* Steps the command a degree at a time, so the servo moves at the given rate rather than
+* at full slew, and servo_angle_at() can tell where it was at any moment. A servo that is
+* still moving, or not yet placed, is sent straight to the angle instead.
+* @param degree angle in degrees to end at
+* @param ms_per_degree rate of the sweep, no faster than SERVO_MS_PER_60 allows
+* @param settled called once the servo has come to rest at the end, or 0
+*/
+void servo_sweep(unsigned degree, unsigned ms_per_degree, void (*settled)(void))
+{
+	if (servo_moving || servo_from == SERVO_UNKNOWN || degree == servo_to) {
+		servo_move_to(degree, settled);
+		return;
+	}
+	if (ms_per_degree * 60 < SERVO_MS_PER_60) {
+		ms_per_degree = (SERVO_MS_PER_60 + 59) / 60;
+	}
+	servo_sweep_from = servo_command = servo_to;
+	servo_to = degree;
+	servo_moving = 1;
+	servo_settled_cb = settled;
+	servo_sweep_ms = ms_per_degree;
+	servo_sweep_tick = sched_ticks();
+	servo_sweep_step();
+}
+
+///Where the servo was at a moment of the sweep under way or last made
+/**
+* The command ramps a degree every ms_per_degree and the servo follows it SERVO_LAG_MS
+* behind. Outside a sweep this is simply the angle last sent.
+* @param ticks time from sched_ticks()
+* @return angle in tenths of a degree
+*/
+int servo_angle_at(uint32_t ticks)
+{
+	long span = (long)servo_sweep_ms * SCHED_TICKS_PER_MS;
+	long moved;
+	unsigned steps;
+	
+	if (!servo_sweep_ms) {
+		return servo_to * 10;
+	}
+	steps = servo_to > servo_sweep_from ? servo_to - servo_sweep_from : servo_sweep_from - servo_to;
+	//The first degree is commanded at servo_sweep_tick, so the ramp is a step ahead
+	moved = ((int32_t)(ticks - servo_sweep_tick) + span - (long)SERVO_LAG_MS * SCHED_TICKS_PER_MS) * 10 / span;
+	if (moved < 0) {
+		moved = 0;
+	} else if (moved > steps * 10L) {
+		moved = steps * 10L;
+	}
+	return servo_to > servo_sweep_from ? servo_sweep_from * 10 + moved : servo_sweep_from * 10 - moved;
+}
+
+///Whether the servo is still on its way
+char servo_busy(void)
+{
+	return servo_moving;
+}
+
+///Angle the servo was last sent to, SERVO_UNKNOWN before the first move
+unsigned servo_position(void)
+{
+	return servo_from == SERVO_UNKNOWN && !servo_moving ? SERVO_UNKNOWN : servo_to;
+}
+
 ///Set servo to degree angle
 /**
-* Moves servo to a degree angle
+* Moves servo to a degree angle and waits for it to settle
 * @param degree angle in degrees to set the servo to
 */
 void move_servo(unsigned degree)
 {
-	OCR3B = servo_degree_calc(degree); // set pulse width
-	wait_ms(5);
+	servo_move_to(degree, 0);
+	while (servo_busy()) {
+		sched_timers_run();
+		hal_idle();
+	}
 }
 
 ///Calculate Servo degree value
 /**
-* Takes in a degree value, and returns the PWM value required (Top value of the WGM)
+* Takes in a degree value, and returns the PWM value required (Top value of the WGM):
+* 800 (0.4 ms) at 0 degrees plus 19.7 a degree, in integer math
 * @param degree desired angle value in degrees
 * @return WGM top value
 */
 unsigned servo_degree_calc(unsigned degree){
-	return (degree * 19.7) + 800;
+	return 800 + ((unsigned long)degree * 197 + 5) / 10;
 }
 
 
@@ -418,9 +777,19 @@ unsigned servo_degree_calc(unsigned degree){
 
 //Serial
 
+// Ring buffers between the USART0 interrupts and the main loop. Head is only written by
+// the producer and tail only by the consumer, so neither side needs to block interrupts.
+static volatile char serial_rx_buf[SERIAL_RX_SIZE];
+static volatile char serial_tx_buf[SERIAL_TX_SIZE];
+static volatile unsigned char serial_rx_head, serial_rx_tail;
+static volatile unsigned char serial_tx_head, serial_tx_tail;
+volatile unsigned int serial_rx_dropped;
+
 ///Initialize USART0 to a given baud rate
 void serial_init(void) {
 	unsigned int baud = 34;// look up in table for correct value
+	serial_rx_head = serial_rx_tail = 0;
+	serial_tx_head = serial_tx_tail = 0;
 	/* Set baud rate */
 	UBRR0H = (unsigned char) (baud >> 8);
 	UBRR0L = (unsigned char)baud;
@@ -428,34 +797,117 @@ void serial_init(void) {
 	UCSR0A = 0b00000010;
 	/* Set frame format: 8 data bits, 2 stop bits */
 	UCSR0C = 0b00010110;
-	/* Enable receiver and transmitter */
-	UCSR0B = 0b00011000;
-	//UCSR0B |= 0b10000000; // optional: receive interrupt enable bit
+	/* Enable receiver, transmitter and the receive interrupt; UDRIE is set once there is something to send */
+	UCSR0B = 0b10011000;
+	sei();
+}
+
+///Receive interrupt, moves the byte into the receive ring
+ISR (USART0_RX_vect) {
+	char data = UDR0;
+	unsigned char next = (serial_rx_head + 1) & (SERIAL_RX_SIZE - 1);
+
+	if (next == serial_rx_tail) {
+		serial_rx_dropped++;
+		return;
+	}
+	serial_rx_buf[serial_rx_head] = data;
+	serial_rx_head = next;
+}
+
+///Data register empty interrupt, feeds the next byte of the transmit ring
+ISR (USART0_UDRE_vect) {
+	if (serial_tx_tail == serial_tx_head) {
+		UCSR0B &= ~_BV(UDRIE0); // nothing left, stop the interrupt
+		return;
+	}
+	UDR0 = serial_tx_buf[serial_tx_tail];
+	serial_tx_tail = (serial_tx_tail + 1) & (SERIAL_TX_SIZE - 1);
+}
+
+///Queue a character without waiting
+/**
+* @param data character to send
+* @return 1 if queued, 0 if the transmit buffer is full
+*/
+int serial_put(char data) {
+	unsigned char next = (serial_tx_head + 1) & (SERIAL_TX_SIZE - 1);
+
+	if (next == serial_tx_tail)
+		return 0;
+	serial_tx_buf[serial_tx_head] = data;
+	serial_tx_head = next;
+	UCSR0B |= _BV(UDRIE0);
+	return 1;
+}
+
+///Take a received character without waiting
+/**
+* @param data where to store the character
+* @return 1 if a character was taken, 0 if none has arrived
+*/
+int serial_get(char *data) {
+	if (serial_rx_tail == serial_rx_head)
+		return 0;
+	*data = serial_rx_buf[serial_rx_tail];
+	serial_rx_tail = (serial_rx_tail + 1) & (SERIAL_RX_SIZE - 1);
+	return 1;
+}
+
+///Look at the next received character without taking it
+/**
+* @return the character, or -1 if none has arrived
+*/
+int serial_peek(void) {
+	if (serial_rx_tail == serial_rx_head)
+		return -1;
+	return (unsigned char) serial_rx_buf[serial_rx_tail];
+}
+
+///Number of received characters waiting
+unsigned char serial_available(void) {
+	return (serial_rx_head - serial_rx_tail) & (SERIAL_RX_SIZE - 1);
+}
+
+///Room left in the transmit buffer
+unsigned char serial_room(void) {
+	return (serial_tx_tail - serial_tx_head - 1) & (SERIAL_TX_SIZE - 1);
+}
+
+///Wait until everything queued has been handed to the USART
+void serial_flush(void) {
+	while (serial_tx_tail != serial_tx_head)
+		hal_idle();
 }
 
 ///Receive a character
 /**
-* Waits for the serial input register is full
-* @return char in serial register
+* Waits until a character is in the receive buffer
+* @return next received char
 */
 char serial_getc() {
-	/* Wait for the receive complete flag (RXC) */
-	while ((UCSR0A & 0b10000000) == 0)
-	;
-	/* Reads data from the receive buffer; clears the receive buffer */
-	return UDR0;
+	char data;
+	while (!serial_get(&data))
+		hal_idle();
+	return data;
 }
 
 ///Send a character
 /**
-* Sends a character over the serial port
+* Queues a character for the serial port, waiting only while the transmit buffer is full
 * @param data character to write to serial port
 */
 void serial_putc(char data) {
-	/* Wait for empty transmit buffer by checking the UDRE bit */
-	while ((UCSR0A & 0b00100000) == 0);
-	/* Put data into transmit buffer; sends the data */
-	UDR0 = data;
+	while (!serial_put(data))
+		hal_idle();
+}
+
+///Send a string from program memory, e.g. serial_putstr_P(PSTR("z"))
+void serial_putstr_P(PGM_P data){
+	char c;
+	while ((c = pgm_read_byte(data++))){
+		serial_putc(c);
+	}
 }
 
 ///Send a string
@@ -471,147 +923,211 @@ void serial_putstr(char data[]){
 	}
 }
 
+///Serial throughput test
+/**
+* Queues count bytes of a repeating 'A' to 'Y' pattern followed by a 'z', as fast as the
+* transmit buffer takes them. Time the gap between the command and the 'z' on the pilot
+* side to get the effective bytes/s at the current UBRR setting.
+* @param count number of pattern bytes to send
+*/
+void serial_throughput(unsigned count) {
+	unsigned i;
+	for (i = 0; i < count; i++) {
+		serial_putc('A' + i % 25);
+	}
+	serial_putc('z');
+}
+
 
 
 //Movement
 
-///Moves forward by distance cm, 1 is forward. -1 is backwards
+// Move in progress, stepped by motion_step(); kind is 0 when idle
+static char motion_kind;
+static int motion_target;
+static int motion_sum;
+static int motion_error;
+static sched_timer_t motion_watchdog; // runs out when the sensor stream stops
+static unsigned motion_epochs; // wheel starts and stops since reset
+
+///End the move in progress with the given result
+static void motion_end(int error) {
+	stop();
+	motion_epochs++;
+	sched_timer_stop(&motion_watchdog);
+	motion_error = error;
+	motion_kind = 0;
+}
+
+///The sensor stream has gone quiet during a move; stop rather than drive blind
+static void motion_lost(void) {
+	motion_end(MOTION_NO_SENSORS);
+}
+
+///Start a move
 /**
-* Sets wheels forward, constantly checks sensor data for errors
-* @param distance distance to move in centimeters
-* @return error value or complete acknowledge
+* Sets the wheels going; motion_step() checks the sensors and stops when done. A move
+* still in progress is stopped first, with MOTION_STOPPED as its result.
+* @param kind 'f' forward, 'b' backward (ignores alerts), 'r' clockwise, 'l' counterclockwise
+* @param amount distance in millimeters, or degrees for a rotation
 */
-int forward(int distance) {
-	oi_t *sensor_data = oi_alloc();
-	oi_init(sensor_data);
-	
-	int ret =0;
-	
+void motion_start(char kind, int amount) {
+	if (motion_kind) {
+		motion_stop();
+	}
+	motion_kind = kind;
+	motion_target = amount;
+	motion_sum = 0;
+	motion_error = 0;
+	motion_epochs++;
+	oi_stream_clear(); // count from here
+	sched_timer_start(&motion_watchdog, MOTION_WATCHDOG_MS, motion_lost);
+
+	switch (kind) {
+		case 'f': oi_set_wheels(200, 200); break;
+		case 'b': oi_set_wheels(-200, -200); break;
+		case 'r': oi_set_wheels(-150, 150); break;
+		case 'l': oi_set_wheels(150, -150); break;
+	}
+}
 
-	int sum = 0;
-	
-	oi_set_wheels(200, 200); //
-	
-	while (sum < distance) {
-		oi_update(sensor_data);
+///Motion task
+/**
+* Checks the sensors each time the Create streams a new frame (every 15 ms) and stops the
+* move once it has gone far enough or, going forward, something is in the way
+*/
+void motion_step(void) {
+	oi_t *sensor_data = &create;
+	int ret = 0;
+
+	if (!motion_kind || !oi_stream_read(sensor_data)) {
+		return;
+	}
+	sched_timer_start(&motion_watchdog, MOTION_WATCHDOG_MS, motion_lost);
+
+	if (motion_kind == 'f') {
 		//Check ALLLLLLL of the sensor data - returns an integer relating to the sensor data
 		if(sensor_data->bumper_left){
 			ret = 1;
-			break;
 		}
 		else if(sensor_data->bumper_right){
 			ret = 2;
-			break;
 		}
 		else if(sensor_data->cliff_left){
 			ret = 3;
-			break;
 		}
 		else if(sensor_data->cliff_right){
 			ret = 4;
-			break;
 		}			
 		else if(sensor_data->cliff_frontleft){
 			ret = 5;
-			break;
 		}		
 		else if(sensor_data->cliff_frontright){
 			ret = 6;
-			break;
 		}		
 		else if(sensor_data->wheeldrop_left){
 			ret = 7;
-			break;
 		}
 		else if(sensor_data->wheeldrop_right){
 			ret = 8;
-			break;
 		}
 		else if(sensor_data->wheeldrop_caster){
 			ret = 9;
-			break;
 		}	
 		else if(sensor_data->virtual_wall){
 			ret = 10;
-			break;
 		}				
 		//BOT 13 cliff left = 400, cliff right = 600, cliff fright = 600, cliff fleft = 500
 		//Cliff sensors
-		if( sensor_data->cliff_left_signal > 400 && sensor_data->cliff_right_signal > 600 && sensor_data->cliff_frontright_signal > 600 && sensor_data->cliff_frontleft_signal > 500  ){
-			lprintf("left: %d\nright: %d\nfrontleft: %d\nfrontright: %d",sensor_data->cliff_left_signal, sensor_data->cliff_left_signal, sensor_data->cliff_frontleft_signal, sensor_data->cliff_frontright_signal);
+		else if( sensor_data->cliff_left_signal > 400 && sensor_data->cliff_right_signal > 600 && sensor_data->cliff_frontright_signal > 600 && sensor_data->cliff_frontleft_signal > 500  ){
+			lprintf_P(PSTR("left: %d\nright: %d\nfrontleft: %d\nfrontright: %d"),sensor_data->cliff_left_signal, sensor_data->cliff_left_signal, sensor_data->cliff_frontleft_signal, sensor_data->cliff_frontright_signal);
 			ret = 255;
-			break;
 		}
-		//Distance Counter
-		sum += abs(sensor_data->distance);
-		wait_ms(10);
+		if (ret) {
+			motion_end(ret);
+			return;
+		}
+	}
+
+	//Distance or rotation counter
+	if (motion_kind == 'f' || motion_kind == 'b') {
+		motion_sum += abs(sensor_data->distance);
+	} else {
+		motion_sum += abs(sensor_data->angle);
+	}
+	if (motion_sum >= motion_target) {
+		motion_end(0);
 	}
-	stop();
-	
-	oi_free(sensor_data);
-	return ret;
 }
 
-/// Go backwards, ignoring all alerts
-/**
-* Sets wheels forward, constantly checks sensor data for errors
-* @param distance distance to move in centimeters
-* @return complete acknowledge
-*/
-int reverse(int distance) {
-	oi_t *sensor_data = oi_alloc();
-	oi_init(sensor_data);
-	
-	int ret =0;
+///Whether a move is in progress
+char motion_busy(void) {
+	return motion_kind != 0;
+}
 
-	int sum = 0;
-	
-	oi_set_wheels(-200, -200); //
-	
-	while (sum < distance) {
-		oi_update(sensor_data);
-		sum += abs(sensor_data->distance);
-		wait_ms(10);
+///Odometry epoch, changed whenever the wheels start or stop
+unsigned motion_epoch(void) {
+	return motion_epochs;
+}
+
+///Result of the last move: 0, an error code from forward(), MOTION_STOPPED or MOTION_NO_SENSORS
+int motion_result(void) {
+	return motion_error;
+}
+
+///Stop the move in progress, if any
+void motion_stop(void) {
+	if (motion_kind) {
+		motion_end(MOTION_STOPPED);
 	}
-	stop();
-	
-	oi_free(sensor_data);
-	return ret;
+}
+
+///Moves forward by distance cm, 1 is forward. -1 is backwards
+/**
+* Sets wheels forward, constantly checks sensor data for errors
+* @param distance distance to move in millimeters
+* @return error value or complete acknowledge
+*/
+int forward(int distance) {
+	motion_start('f', distance);
+	while (motion_kind) {
+		motion_step();
+		sched_timers_run();
+		hal_idle();
+	}
+	return motion_error;
+}
+
+/// Go backwards, ignoring all alerts
+/**
+* Sets wheels backward until the distance is covered
+* @param distance distance to move in millimeters
+* @return complete acknowledge
+*/
+int reverse(int distance) {
+	motion_start('b', distance);
+	while (motion_kind) {
+		motion_step();
+		sched_timers_run();
+		hal_idle();
+	}
+	return motion_error;
 }
 
 
 ///Rotate for a specified amount
 /**
-* Sets wheels forward, constantly checks sensor data for errors
+* Turns in place until the Create has turned far enough
 * @param degrees degrees to move
 * @param direction 1 for clockwise, -1 for counterclockwise
 */
 void rotate(int degrees,int direction) {
-	if(direction>0){
-		direction=1;
-	}
-	else
-	{
-		direction=-1;
+	motion_start(direction > 0 ? 'r' : 'l', degrees);
+	while (motion_kind) {
+		motion_step();
+		sched_timers_run();
+		hal_idle();
 	}
-	//makes input valid regardless
-	
-	//Allocates and intializes sensor data
-	oi_t *sensor_data = oi_alloc();
-	oi_init(sensor_data);
-	
-	//Rotational Counter
-	int sum = 0;
-	//Turn in a direction
-	oi_set_wheels(-150*direction, 150*direction);
-	while (sum < degrees) {
-		oi_update(sensor_data);
-		sum += abs(sensor_data->angle);
-		wait_ms(5);
-	}
-	stop();
-	
-	oi_free(sensor_data);
 }
 
 
@@ -628,6 +1144,12 @@ void dodonuts(){
 
 ///Initialize Everything
 void init_all(){
+	sched_init();
+	oi_init(&create);
+	oi_load_song_P(SONG_VICTORY, 16, victory_notes, victory_duration);
+	oi_load_song_P(SONG_VICTORY_END, 10, victory_notes + 16, victory_duration + 16);
+	oi_load_song_P(SONG_BEEP, 1, beep_note, beep_duration);
+	oi_load_song_P(SONG_ERROR, 3, error_notes, error_duration);
 	lcd_init();
 	servo_init();
 	init_push_buttons();
@@ -639,244 +1161,1089 @@ void init_all(){
 }
 
 
-///Scan/Sonar function
+
+//Scan
+
+// Sweep in progress, stepped by scan_step()
+#define SCAN_IDLE 0
+#define SCAN_WAIT 1
+#define SCAN_MOVE 2
+#define SCAN_SETTLE 3
+#define SCAN_SAMPLE 4
+#define SCAN_PING 5
+#define SCAN_NEXT 6
+#define SCAN_GLIDE 7
+#define SCAN_REPLAY 8
+static char scan_phase;
+static char scan_fast; // IR only
+static int scan_averages;
+static int scan_angle;
+static int scan_dir; // +1 sweeping up from scan_lo, -1 down from scan_hi
+static int scan_stride; // degrees between samples
+static int scan_lo; // sector swept, in degrees
+static int scan_hi;
+#define SCAN_PASS_ONE 0
+#define SCAN_PASS_COARSE 1
+#define SCAN_PASS_FINE 2
+#define SCAN_PASS_GLIDE 3
+#define SCAN_PASS_REPLAY 4 // detection over the last sweep's store, see scan_from_cache()
+static char scan_pass;
+static int scan_fine_averages;
+static uint8_t scan_wanted[(180 + 7) / 8]; // degrees the fine pass samples, a bit each
+static char scan_filter = SCAN_FILTER_MEAN;
+static char scan_sequential; // stop sampling a degree once its samples agree
+static char scan_watching; // start the next sweep when one ends
+static int scan_watch_averages; // 0 for continuous sweeps
+static unsigned long scan_taken; // samples taken this sweep
+static int scan_prev_angle = -1; // last degree done, -1 for none, and its readings in mm
+static uint16_t scan_prev_ping;
+static uint16_t scan_prev_ir;
+static int scan_sample;
+static int scan_echoes; // samples whose ping got an echo
+static uint16_t scan_ping_mm[SCAN_MAX_SAMPLES]; // samples of the degree, pings with an echo only
+static uint16_t scan_ir_mm[SCAN_MAX_SAMPLES];
+static int scan_ping; // the degree once filtered, in centimeters
+static int scan_ir;
+static int scan_spread;
+
+// Continuous sweep: samples summed per degree, over the degrees from scan_angle on that
+// have not been handed to detection yet
+static struct scan_bin {
+	uint16_t ping_sum; // millimeters, echoes only
+	uint8_t pings;
+	uint8_t misses;
+	uint16_t ir_sum;
+	uint8_t irs;
+} scan_bins[SCAN_GLIDE_BINS];
+static char scan_pinging;
+static uint32_t scan_ping_tick; // when the ping in flight was started
+static int scan_ping_at; // last ping, in tenths of a degree, and its reading in centimeters
+static int scan_ping_last;
+static int scan_ir_last; // centimeters, held over degrees no IR value fell in
+
+// Object being followed by scan_detect(): the run of near degrees seen so far
+static int scan_run_first; // -1 when there is none
+static int scan_run_last;
+static long scan_run_sum; // distance summed over the run, in centimeters
+static int scan_run_spread; // largest spread in the run
+static long scan_run_ir_sum; // IR alone, for the edges
+static long scan_run_sigma; // fused standard deviations summed over the run
+static int scan_run_lead_ir; // IR at the first degree of the run and at the one before
+static int scan_run_lead_bg;
+static int scan_run_tail_ir; // IR at the last degree of the run
+static int scan_objects; // objects reported this sweep
+static int scan_last_angle; // degree detection saw last, -1 for none, and what it read
+static char scan_last_near;
+static int scan_last_ir;
+
+// Records of the sweep being taken, and of the one before while the link still sends them
+static struct scan_out {
+	char text[SCAN_OUT_SIZE];
+	unsigned char len;
+	char sealed; // the sweep is over, the buffer is free once sent
+} scan_out[2];
+static char scan_out_fill; // buffer the sweep writes
+static char scan_out_drain; // buffer going out, the fill one or the other, sealed
+static unsigned char scan_out_sent; // bytes of it queued for the USART
+static unsigned char scan_z_owed; // z of sweeps stopped while waiting for a buffer
+#define SCAN_RECORD_MAX 40 // longest object record, o45u9999r999x-1799y1799d999s179e179q
+#define SCAN_TRAILER_MAX 16 // n<samples>z
+
+// What the sweep saw, packed: one entry per degree, the angle being the index
+static struct scan_degree {
+	uint16_t ping; // centimeters, SONAR_NO_ECHO for none
+	uint8_t ir; // centimeters up to 255, 0 for a degree not looked at
+} scan_degrees[180];
+#define SCAN_CACHE_NONE -1
+static unsigned scan_cache_epoch; // odometry epoch the store was taken in
+static char scan_cache_moving; // the wheels were turning when the sweep began
+static int scan_cache_averages = SCAN_CACHE_NONE; // averages of the store, 0 for IR only
+#define SCAN_EDGE_NONE -1 // no reading past an edge
+#define SCAN_EDGE_SPLIT -2 // an edge shared with the next object
+
+// The servo has reached scan_angle
+static void scan_settled(void)
+{
+	if (scan_phase != SCAN_SETTLE) {
+		return; // sweep abandoned meanwhile
+	}
+	if (scan_pass == SCAN_PASS_GLIDE) {
+		//At the start end: set off for the other, sampling all the way
+		servo_sweep(scan_dir > 0 ? scan_hi : scan_lo, SCAN_GLIDE_MS_PER_DEG, 0);
+		ir_start(2);
+		scan_phase = SCAN_GLIDE;
+		return;
+	}
+	scan_sample = 0;
+	scan_echoes = 0;
+	scan_phase = SCAN_SAMPLE;
+}
+
+// Whether angle is in the sector being swept
+static char scan_in(int angle)
+{
+	return angle >= scan_lo && angle <= scan_hi;
+}
+
+// Set up a single pass over lo to hi from the end the servo is nearer
+static void scan_begin(int lo, int hi, int step, int averages, char fast)
+{
+	unsigned from = servo_position();
+	
+	scan_run_first = -1;
+	scan_last_angle = -1;
+	scan_objects = 0;
+	memset(scan_degrees, 0, sizeof(scan_degrees));
+	scan_cache_averages = SCAN_CACHE_NONE;
+	scan_cache_epoch = motion_epoch();
+	scan_cache_moving = motion_busy();
+	scan_taken = 0;
+	scan_sequential = 0;
+	scan_prev_angle = -1;
+	scan_lo = lo;
+	scan_hi = hi;
+	scan_averages = averages < 1 ? 1 : averages > SCAN_MAX_SAMPLES ? SCAN_MAX_SAMPLES : averages;
+	scan_fast = fast;
+	scan_pass = SCAN_PASS_ONE;
+	scan_stride = step;
+	scan_dir = from != SERVO_UNKNOWN && from * 2 >= (unsigned)(lo + hi) ? -1 : 1;
+	scan_angle = scan_dir > 0 ? lo : hi;
+	scan_phase = SCAN_WAIT;
+}
+
+///Start a sweep
+/**
+* scan_step() loops over the 180 degrees, taking averages ping and IR readings at each
+* (IR only for a fast scan) once the servo has settled. Each object is sent over serial
+* as soon as the sweep has passed its far edge; after the last come n and the number of
+* samples taken, and a z. The sweep
+* starts from the end the servo is nearer, so back to back scans go 0 to 179 and 179 to
+* 0 in turn without rewinding. Objects go out, and are numbered, in the order the sweep
+* meets them, so from 179 down on a sweep from 179; within a record s, e, x and y are
+* lower angle first either way.
+* @param averages number of averages to take per degree
+* @param fast 1 for the IR only scan
+*/
+void scan_start(int averages, char fast)
+{
+	scan_begin(0, 179, 1, averages, fast);
+}
+
+///Start a sweep that samples each degree only until the samples agree
+/**
+* As scan_start() with ping and IR, but a degree is done as soon as its samples are
+* within SCAN_AGREE_MM standard deviation, or after cap samples. A first sample within
+* SCAN_AGREE_MM of the degree before, on both sensors, is taken on its own, so a clean
+* sweep goes at nearly one sample a degree and the extra samples go to the edges and the
+* noisy degrees.
+* @param cap most samples to take per degree
+*/
+void scan_start_sequential(int cap)
+{
+	scan_begin(0, 179, 1, cap, 0);
+	scan_sequential = 1;
+}
+
+///Start a continuous sweep
+/**
+* The servo sweeps the 180 degrees without stopping at SCAN_GLIDE_MS_PER_DEG while the
+* sonar pings back to back and every IR value is used. Each sample is placed at the angle
+* servo_angle_at() gives for its middle, and the samples of a degree are averaged; a
+* degree no ping fell in takes the nearest ping. Objects stream out as for scan_start(),
+* and n counts the pings.
+*/
+void scan_start_glide(void)
+{
+	scan_begin(0, 179, 1, 1, 0);
+	scan_pass = SCAN_PASS_GLIDE;
+	scan_pinging = 0;
+	scan_ping_at = -1;
+	scan_ir_last = SONAR_NO_ECHO;
+	memset(scan_bins, 0, sizeof(scan_bins));
+}
+
+///Sweep over and over until stopped
+/**
+* Each sweep is answered as scan_start() or scan_start_glide() would, ending in n and a
+* z, and the next one sets off as soon as it ends, from the end the servo is at, while
+* the link is still sending its objects.
+* @param averages number of averages per degree, 0 for continuous sweeps
+*/
+void scan_start_watch(int averages)
+{
+	if (averages) {
+		scan_start(averages, 0);
+	} else {
+		scan_start_glide();
+	}
+	scan_watching = 1;
+	scan_watch_averages = averages;
+}
+
+///Start a sweep over a sector
+/**
+* As scan_start() with ping and IR, over start to end degrees only, a reading every step
+* degrees standing for the degrees up to the next one. An object running past either end
+* is reported up to that end.
+* @param start first angle of the sector, 0 to 179
+* @param end last angle of the sector, start to 179
+* @param step degrees between readings, 1 to SCAN_MAX_STEP
+* @param averages number of averages to take per reading
+* @return 1 if the sweep started, 0 if the sector was out of range
+*/
+char scan_start_sector(int start, int end, int step, int averages)
+{
+	if (start < 0 || end > 179 || start > end || step < 1 || step > SCAN_MAX_STEP) {
+		return 0;
+	}
+	scan_begin(start, end, step, averages, 0);
+	return 1;
+}
+
+///Start a coarse to fine sweep
+/**
+* A fast IR only pass every SCAN_COARSE_STEP degrees, then a pass back over just the
+* degrees within a step of a coarse reading under SCAN_COARSE_RANGE, with ping and IR
+* at the given averages. Detection runs along the fine pass, which hands it the degrees
+* it skips with their coarse IR reading and no echo.
+* @param averages number of averages to take per degree in the fine pass
+*/
+void scan_start_adaptive(int averages)
+{
+	scan_start(1, 1);
+	scan_fine_averages = averages < 1 ? 1 : averages > SCAN_MAX_SAMPLES ? SCAN_MAX_SAMPLES : averages;
+	scan_pass = SCAN_PASS_COARSE;
+	scan_stride = SCAN_COARSE_STEP;
+	memset(scan_wanted, 0, sizeof(scan_wanted));
+}
+
+// Mark degrees from to to for the fine pass
+static void scan_want(int from, int to)
+{
+	if (from < scan_lo) {
+		from = scan_lo;
+	}
+	for (; from <= to && from <= scan_hi; from++) {
+		scan_wanted[from >> 3] |= 1 << (from & 7);
+	}
+}
+
+// Next angle of the pass after angle, out of the sector once the pass is done
+static int scan_next(int angle)
+{
+	if (scan_pass != SCAN_PASS_FINE) {
+		return angle + scan_dir * scan_stride;
+	}
+	do {
+		angle += scan_dir;
+	} while (scan_in(angle) && !(scan_wanted[angle >> 3] & (1 << (angle & 7))));
+	return angle;
+}
+
+///Choose how the samples of a degree are combined
 /**
-* Loops 0 to 180, setting the servo to that degree setting
-* then takes ave_num number of scans, on both ping and IR
-* Averages those reads, and writes them to the sensor_reading struct
-* After reading is done, munch through the sensor_reading, and detect objects
-* After objects have been detected from raw sensor data, format and send over serial
-* @param ave_size number of averages to take per degree
+* @param filter SCAN_FILTER_MEAN, SCAN_FILTER_MEDIAN, SCAN_FILTER_TRIMMED or SCAN_FILTER_HAMPEL
+* @return 1 if the filter was set, 0 if there is no such filter
 */
-void scan(int ave_size)
+char scan_set_filter(unsigned filter)
 {
-	move_servo(0);
-	wait_ms(700);
-	int ping_distance=0;
-	int ir_distance=0;
+	//SCAN_FILTER_MEAN is 0: anything below it wraps round past the last
+	if (filter > SCAN_FILTER_HAMPEL) {
+		return 0;
+	}
+	scan_filter = filter;
+	scan_cache_averages = SCAN_CACHE_NONE; // its degrees were combined the old way
+	return 1;
+}
+
+// Sort a few samples in place
+static void scan_sort(uint16_t *x, int n)
+{
+	int i, j;
+	uint16_t v;
+	
+	for (i = 1; i < n; i++) {
+		v = x[i];
+		for (j = i; j > 0 && x[j - 1] > v; j--) {
+			x[j] = x[j - 1];
+		}
+		x[j] = v;
+	}
+}
+
+// Median of sorted samples
+static uint16_t scan_median(const uint16_t *x, int n)
+{
+	return n & 1 ? x[n / 2] : (x[n / 2 - 1] + x[n / 2] + 1) / 2;
+}
+
+// Combine the samples of a degree with scan_filter
+/**
+* The spread is the median absolute deviation from the median, whatever the filter.
+* @param x samples in millimeters, sorted on return
+* @param n number of samples, none giving SONAR_NO_ECHO
+* @param spread set to the spread in centimeters
+* @return the degree's distance in centimeters
+*/
+static int scan_combine(uint16_t *x, int n, int *spread)
+{
+	uint16_t dev[SCAN_MAX_SAMPLES];
+	uint16_t median;
+	uint16_t mad;
+	uint16_t off;
+	long sum = 0;
+	int i, kept = 0;
+	int trim = 0;
+	
+	*spread = 0;
+	if (n == 0) {
+		return SONAR_NO_ECHO;
+	}
+	scan_sort(x, n);
+	median = scan_median(x, n);
+	for (i = 0; i < n; i++) {
+		dev[i] = x[i] > median ? x[i] - median : median - x[i];
+	}
+	scan_sort(dev, n);
+	mad = scan_median(dev, n);
+	*spread = (mad + 5) / 10;
+	
+	switch (scan_filter) {
+		case SCAN_FILTER_MEDIAN:
+			return (median + 5) / 10;
+		case SCAN_FILTER_TRIMMED:
+			//A quarter off each end
+			trim = (n + 1) / 4;
+			break;
+	}
+	for (i = trim; i < n - trim; i++) {
+		//Hampel: samples more than 3 standard deviations (1.4826 MAD each) out are dropped
+		off = x[i] > median ? x[i] - median : median - x[i];
+		if (scan_filter == SCAN_FILTER_HAMPEL && off * 20L > mad * 89L) {
+			continue;
+		}
+		sum += x[i];
+		kept++;
+	}
+	return (sum / kept + 5) / 10;
+}
+
+// Whether the samples so far are within SCAN_AGREE_MM standard deviation of each other
+/**
+* n var = sum((x - mean)^2), taken about the mean rounded to a mm, which overstates it by
+* at most n / 4. Each square is under 10^8 for samples up to SONAR_NO_ECHO_MM, so
+* SCAN_MAX_SAMPLES of them fit an unsigned long; n sum(x^2) - sum(x)^2 would not.
+*/
+static char scan_agree(const uint16_t *x, int n)
+{
+	unsigned long sum = 0;
+	unsigned long squares = 0;
+	unsigned mean;
+	long d;
 	int i;
-	//Object loop counter
-	int j;
-	//Object counter
-	int currentObject = 0;
-	//Message string
-	char str[200];
-	
-	//Sensor Data storage
-	struct sensor_reading{
-		int angle_reading;
-		int ping_reading;
-		int ir_reading;
-		int object;
-	};
-	
-	//Data on objects detected
-	struct object {
-		int distance;
-		int start_angle;
-		int end_angle;
-		int size;
-	};
-	
-	struct sensor_reading sensor_data[200];
-	struct object object_detected[15];
-	
-	int angle = 0;
-	int distance_index = 0;
-	
-	//Starting line for serial printing
-	//serial_putstr("\r\n\n\n***********************************\r\nDegrees\t\tIR Distance\tSonar Distance\tObject");
-	
-	//Move servo by 1 degree every tick
-	for (angle=0; angle<180; angle++){
-		move_servo(angle);
-		wait_ms(10);
-		
-		ping_distance = 0;
-		ir_distance = 0;
-		//Average Ping and IR Reads by taking 4 readings
-		for (i=0;i<ave_size;i++)
-		{
-			ping_distance += ping_read();
-			ir_distance += ir_read(2);
-			wait_ms(1);
+	
+	if (n < 2) {
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		sum += x[i];
+	}
+	mean = (sum + n / 2) / n;
+	for (i = 0; i < n; i++) {
+		d = (long)x[i] - mean;
+		squares += d * d;
+	}
+	return squares <= (unsigned long)n * SCAN_AGREE_MM * SCAN_AGREE_MM;
+}
+
+// Whether two readings are within SCAN_AGREE_MM of each other
+static char scan_near(uint16_t a, uint16_t b)
+{
+	return (a > b ? a - b : b - a) <= SCAN_AGREE_MM;
+}
+
+// Whether the degree needs no more samples
+static char scan_enough(void)
+{
+	if (scan_sample >= scan_averages) {
+		return 1;
+	}
+	if (!scan_sequential) {
+		return 0;
+	}
+	//A first sample in line with the degree before stands, like two samples that agree
+	if (scan_sample == 1 && scan_prev_angle >= 0 && scan_angle == scan_prev_angle + scan_dir) {
+		return scan_near(scan_ir_mm[0], scan_prev_ir)
+			&& (scan_echoes ? scan_near(scan_ping_mm[0], scan_prev_ping) : scan_prev_ping == 0);
+	}
+	//Pings all unanswered agree as well; a mix of echoes and none does not
+	return scan_agree(scan_ir_mm, scan_sample)
+		&& (scan_echoes == 0 ? scan_sample >= 2 : scan_echoes == scan_sample && scan_agree(scan_ping_mm, scan_echoes));
+}
+
+// Tenths of a degree an edge lies past the outermost degree of its object
+/**
+* The IR spot at that degree is partly on the object: its reading between the object's
+* and the background's gives how much, and so how far across the degree the edge is.
+* @param ir IR reading at the outermost degree of the object
+* @param bg IR reading at the degree past it, SCAN_EDGE_NONE or SCAN_EDGE_SPLIT
+* @param object IR distance of the object
+* @return -5 to 5
+*/
+static int scan_edge(int ir, int bg, int object)
+{
+	long tenths;
+	
+	if (bg == SCAN_EDGE_SPLIT) {
+		return 5; // between two objects: halfway
+	}
+	if (bg == SCAN_EDGE_NONE || bg <= object) {
+		return 0;
+	}
+	tenths = 10L * (bg - ir) / (bg - object) - 5;
+	return tenths < -5 ? -5 : tenths > 5 ? 5 : tenths;
+}
+
+// Queue whole records from the oldest output buffer for the USART, as far as there is room
+static void scan_drain(void)
+{
+	struct scan_out *out = &scan_out[(int)scan_out_drain];
+	unsigned char end;
+	
+	for (;;) {
+		//Records end in q or z; one never goes out in pieces between other replies
+		end = scan_out_sent;
+		while (end < out->len && out->text[end] != 'q' && out->text[end] != 'z') {
+			end++;
 		}
-		ping_distance = ping_distance/ave_size;
-		ir_distance = ir_distance/ave_size;
-		
-		//Write angle, ping, and IR distance to the sensor data struct
-		sensor_data[angle].angle_reading=angle;
-		sensor_data[angle].ping_reading=ping_distance;
-		sensor_data[angle].ir_reading=ir_distance;
-		sensor_data[angle].object = -1;
-	}
-	
-	for(j=1;j<180;j++){
-		if((sensor_data[j].ir_reading<90) && (sensor_data[j].ping_reading < 90)){
-			//New object
-			if(sensor_data[j-1].object != currentObject){
-				//Increment object counter
-				currentObject++;
-				//Write object index into sensor data
-				sensor_data[j].object = currentObject;
-				//Set the object_detected start angle
-				object_detected[currentObject].start_angle = j;
-			}
-			//Same object
-			else {
-				//Writes the object index to the sensor data
-				sensor_data[j].object = currentObject;
-			}
+		if (end == out->len || end + 1 - scan_out_sent > serial_room()) {
+			break;
 		}
-		else{
-			//Check the previous scan, see if it was the current object
-			if (sensor_data[j-1].object == currentObject){
-				//Set the end angle
-				object_detected[currentObject].end_angle = j-1;
-				//Set the angle size
-				object_detected[currentObject].size = object_detected[currentObject].end_angle - object_detected[currentObject].start_angle;
-				//Calculate the angle/index of the center of the object
-				distance_index = (object_detected[currentObject].start_angle + object_detected[currentObject].end_angle)/2;
-				//Record the distance
-				object_detected[currentObject].distance = (sensor_data[distance_index].ir_reading + sensor_data[distance_index].ping_reading)/2;
-				if (object_detected[currentObject].size  > 2){
-					//Formate and send the data via serial
-					sprintf(str,"o%id%is%ie%iq",currentObject, object_detected[currentObject].distance, object_detected[currentObject].start_angle, object_detected[currentObject].end_angle);
-					serial_putstr(str);
-				}					
-			}	
-		}			
+		while (scan_out_sent <= end) {
+			serial_put(out->text[scan_out_sent++]);
+		}
+	}
+	if (scan_out_sent == out->len && out->sealed) {
+		out->sealed = 0;
+		out->len = 0;
+		scan_out_sent = 0;
+		scan_out_drain ^= 1;
+	} else if (scan_out_sent && scan_out_drain == scan_out_fill) {
+		//The sweep is still writing this one: make room behind what has gone
+		out->len -= scan_out_sent;
+		memmove(out->text, out->text + scan_out_sent, out->len);
+		scan_out_sent = 0;
+	}
+}
+
+// Whether the sweep's output buffer can take what the next degrees handed to detection send
+/**
+* A reported object spans at least 4 degrees and ends at the degree after it, so degrees
+* readings end at most 1 + (degrees - 1) / 4 objects. The room for a trailer is always
+* kept, so that scan_stop() and scan_finish() never have to wait.
+* @param degrees calls to scan_detect() or scan_object_end() to come
+*/
+static char scan_out_room(int degrees)
+{
+	struct scan_out *out = &scan_out[(int)scan_out_fill];
+	
+	return !out->sealed && SCAN_OUT_SIZE - out->len >= (1 + (degrees - 1) / 4) * SCAN_RECORD_MAX + SCAN_TRAILER_MAX;
+}
+
+// Add a record to the sweep's output buffer; scan_out_room() has made sure it fits
+static void scan_emit(const char *str)
+{
+	struct scan_out *out = &scan_out[(int)scan_out_fill];
+	unsigned char len = strlen(str);
+	
+	if (out->sealed || out->len + len > SCAN_OUT_SIZE) {
+		return;
+	}
+	memcpy(out->text + out->len, str, len);
+	out->len += len;
+}
+
+// scan_emit() for a record in program memory
+static void scan_emit_P(PGM_P str)
+{
+	struct scan_out *out = &scan_out[(int)scan_out_fill];
+	unsigned char len = strlen_P(str);
+	
+	if (out->sealed || out->len + len > SCAN_OUT_SIZE) {
+		return;
 	}
+	memcpy_P(out->text + out->len, str, len);
+	out->len += len;
+}
+
+// End the sweep's output; the next sweep writes the other buffer
+static void scan_seal(void)
+{
+	scan_out[(int)scan_out_fill].sealed = 1;
+	scan_out_fill ^= 1;
+}
 
-	//Send a z character to indicate end of transmission
-	serial_putstr("z");
+// Send the object followed so far, if it spans more than 2 degrees
+/**
+* @param bg IR reading of the degree past the object, SCAN_EDGE_NONE if that was not
+* looked at, or SCAN_EDGE_SPLIT if it starts the next object
+*/
+static void scan_object_end(int bg)
+{
+	//Message string
+	char str[80];
+	int start = scan_run_first < scan_run_last ? scan_run_first : scan_run_last;
+	int end = scan_run_first < scan_run_last ? scan_run_last : scan_run_first;
+	int count = end - start + 1;
+	int object = (scan_run_ir_sum + count / 2) / count;
+	int lead = scan_run_first * 10 - scan_dir * scan_edge(scan_run_lead_ir, scan_run_lead_bg, object);
+	int trail = scan_run_last * 10 + scan_dir * scan_edge(scan_run_tail_ir, bg, object);
 	
+	scan_run_first = -1;
+	if (end - start <= 2) {
+		return;
+	}
+	//Formate and send the data via serial, the distance being the average fused range over
+	//the object, r its average standard deviation, u the largest spread of its degrees and
+	//x and y its edges in tenths of a degree (ahead of d, where older pilots skip them)
+	sprintf_P(str, PSTR("o%iu%ir%lix%iy%id%lis%ie%iq"), ++scan_objects, scan_run_spread, (scan_run_sigma + count / 2) / count,
+		lead < trail ? lead : trail, lead < trail ? trail : lead, (scan_run_sum + count / 2) / count, start, end);
+	scan_emit(str);
+	if (scan_fast) {
+		lprintf(str);
+	}
 }
 
-///Scan/Sonar function
+// Integer square root
+static unsigned scan_sqrt(unsigned long x)
+{
+	unsigned long root = 0;
+	unsigned long bit = 1UL << 30;
+	
+	while (bit > x) {
+		bit >>= 2;
+	}
+	while (bit) {
+		if (x >= root + bit) {
+			x -= root + bit;
+			root = (root >> 1) + bit;
+		} else {
+			root >>= 1;
+		}
+		bit >>= 2;
+	}
+	return root;
+}
+
+// Fuse a degree's ping and IR into one range
 /**
-* Loops 0 to 180, setting the servo to that degree setting
-* then takes one scan on just the IR and writes it to the sensor_reading struct
-* After reading is done, munch through the sensor_reading, and detect objects
-* After objects have been detected from raw sensor data, format and send over serial
+* Each sensor's variance comes from its model: the IR's SCAN_IR_SIGMA_MM grows with the
+* square of the distance as the ranger's curve flattens, the sonar's SCAN_PING_SIGMA_MM
+* barely grows. Readings that agree to within three combined standard deviations are
+* weighted by inverse variance, which leaves the range mostly to the sonar past a short
+* distance. A ping much nearer than the IR has found something else in its wide cone, so
+* the narrow IR stands alone; a ping much farther, or none, contradicts the IR, and the
+* standard deviation becomes the disagreement.
+* @param ping centimeters, SONAR_NO_ECHO for none
+* @param ir centimeters
+* @param sigma set to the fused standard deviation in centimeters
+* @return fused range in centimeters
 */
-void scanfast()
+static int scan_fuse(int ping, int ir, int *sigma)
+{
+	long ir_mm = ir * 10L;
+	long ping_mm = ping * 10L;
+	unsigned long ir_sigma = SCAN_IR_SIGMA_MM * ir_mm * ir_mm / ((long)SCAN_IR_SIGMA_REF_MM * SCAN_IR_SIGMA_REF_MM) + 1;
+	unsigned long ping_sigma = SCAN_PING_SIGMA_MM + ping_mm / 100;
+	unsigned long ir_var = ir_sigma * ir_sigma;
+	unsigned long ping_var = ping_sigma * ping_sigma;
+	long diff = ping_mm - ir_mm;
+	
+	if (scan_fast || (ping != SONAR_NO_ECHO && diff < 0 && (unsigned long)diff * diff > 9 * (ir_var + ping_var))) {
+		*sigma = (ir_sigma + 5) / 10;
+		return ir;
+	}
+	if (ping == SONAR_NO_ECHO || (unsigned long)diff * diff > 9 * (ir_var + ping_var)) {
+		*sigma = ping == SONAR_NO_ECHO ? SONAR_NO_ECHO : (labs(diff) + 5) / 10;
+		return ir;
+	}
+	*sigma = (scan_sqrt(ir_var * ping_var / (ir_var + ping_var)) + 5) / 10;
+	return (ir_mm * ping_var + ping_mm * ir_var) / (long)(ir_var + ping_var) / 10;
+}
+
+// Follow objects degree by degree, in the order of the sweep
+/**
+* An object is a run of adjacent degrees whose fused range is closer than 90 cm with a
+* standard deviation of at most SCAN_TRUST_CM (IR closer than 150 for a fast scan), so an
+* edge is where the IR leaves the object, and whose IR distance changes by no more than SCAN_JUMP_CM from one
+* degree to the next; a bigger jump ends it and starts the next. The IR spot is narrow
+* where the sonar cone would blur two objects into one. It is sent once a degree past
+* it reads far or jumps, or the pass skips or ends, with no limit on how many a sweep
+* has.
+*/
+static void scan_detect(int angle, int ping, int ir, int spread)
+{
+	char near;
+	char adjacent = scan_last_angle >= 0 && angle == scan_last_angle + scan_dir;
+	int sigma;
+	int distance = scan_fuse(ping, ir, &sigma);
+	
+	scan_degrees[angle].ping = ping;
+	scan_degrees[angle].ir = ir > 255 ? 255 : ir;
+	if (scan_fast) {
+		near = ir < 150;
+	} else {
+		near = distance < 90 && sigma <= SCAN_TRUST_CM;
+	}
+	if (scan_run_first >= 0) {
+		if (!adjacent) {
+			scan_object_end(SCAN_EDGE_NONE);
+		} else if (!near) {
+			scan_object_end(ir);
+		} else if (abs(ir - scan_last_ir) > SCAN_JUMP_CM) {
+			scan_object_end(SCAN_EDGE_SPLIT);
+		}
+	}
+	if (near) {
+		if (scan_run_first < 0) {
+			scan_run_first = angle;
+			scan_run_sum = 0;
+			scan_run_ir_sum = 0;
+			scan_run_spread = 0;
+			scan_run_sigma = 0;
+			scan_run_lead_ir = ir;
+			scan_run_lead_bg = !adjacent ? SCAN_EDGE_NONE : scan_last_near ? SCAN_EDGE_SPLIT : scan_last_ir;
+		}
+		if (spread > scan_run_spread) {
+			scan_run_spread = spread;
+		}
+		scan_run_last = angle;
+		scan_run_sum += distance;
+		scan_run_sigma += sigma;
+		scan_run_ir_sum += ir;
+		scan_run_tail_ir = ir;
+	}
+	scan_last_angle = angle;
+	scan_last_near = near;
+	scan_last_ir = ir;
+}
+
+// Hand the reading to detection for the degrees it stands for: up to the next sample of the pass
+static void scan_store(void)
 {
-	move_servo(0);
-	wait_ms(700);
-	int ir_distance=0;
 	int i;
-	//Object loop counter
-	int j;
-	//Object counter
-	int currentObject = 0;
-	//Message string
-	char str[200];
-	
-	//Sensor Data storage
-	struct sensor_reading{
-		int angle_reading;
-		int ir_reading;
-		int object;
-	};
-	
-	//Data on objects detected
-	struct object {
-		int distance;
-		int start_angle;
-		int end_angle;
-		int size;
-	};
-	
-	struct sensor_reading sensor_data[200];
-	struct object object_detected[15];
-	
-	int angle = 0;
-	int distance_index = 0;
-	
-	//Starting line for serial printing
-	//serial_putstr("\r\n\n\n***********************************\r\nDegrees\t\tIR Distance\tSonar Distance\tObject");
-	
-	//Move servo by 1 degree every tick
-	for (angle=0; angle<180; angle++){
-		move_servo(angle);
-		wait_ms(5);
-		ir_distance = ir_read(2);
-		
-		//Write angle, ping, and IR distance to the sensor data struct
-		sensor_data[angle].angle_reading=angle;
-		sensor_data[angle].ir_reading=ir_distance;
-		sensor_data[angle].object = -1;
-	}
-	
-	for(j=1;j<180;j++){
-		if((sensor_data[j].ir_reading<150)){
-			//New object
-			if(sensor_data[j-1].object != currentObject){
-				//Increment object counter
-				currentObject++;
-				//Write object index into sensor data
-				sensor_data[j].object = currentObject;
-				//Set the object_detected start angle
-				object_detected[currentObject].start_angle = j;
+	int a = scan_angle;
+	
+	if (scan_pass == SCAN_PASS_COARSE) {
+		if (scan_ir < SCAN_COARSE_RANGE) {
+			scan_want(scan_angle - scan_stride + 1, scan_angle + scan_stride - 1);
+		}
+		//Kept for the degrees the fine pass skips
+		for (i = 0; i < scan_stride && scan_in(a); i++, a += scan_dir) {
+			scan_degrees[a].ping = SONAR_NO_ECHO;
+			scan_degrees[a].ir = scan_ir > 255 ? 255 : scan_ir;
+		}
+		return;
+	}
+	for (i = 0; i < scan_stride && scan_in(a); i++, a += scan_dir) {
+		scan_detect(a, scan_ping, scan_ir, scan_spread);
+	}
+}
+
+// Hand detection the degrees the fine pass skips, from from up to to, as the coarse pass read them
+static void scan_coarse_fill(int from, int to)
+{
+	for (; from != to && scan_in(from); from += scan_dir) {
+		scan_detect(from, scan_degrees[from].ping, scan_degrees[from].ir, 0);
+	}
+}
+
+// Hand the sweep's last object, the sample count and the z to the pilot
+static void scan_finish(void)
+{
+	char str[16];
+	
+	if (scan_run_first >= 0) {
+		scan_object_end(SCAN_EDGE_NONE);
+	}
+	sprintf_P(str, PSTR("n%luz"), scan_taken);
+	scan_emit(str);
+	scan_seal();
+	scan_phase = SCAN_IDLE;
+	//A whole 180 degrees from one spot, the wheels still all along, can answer the next sweep
+	if (scan_lo == 0 && scan_hi == 179 && scan_stride == 1 && scan_pass != SCAN_PASS_FINE
+	    && scan_pass != SCAN_PASS_REPLAY && scan_cache_epoch == motion_epoch()
+	    && !scan_cache_moving && !motion_busy()) {
+		scan_cache_averages = scan_fast ? 0 : scan_pass == SCAN_PASS_GLIDE || scan_sequential ? 1 : scan_averages;
+	}
+	if (scan_watching) {
+		//Straight on with the next sweep while the link sends this one
+		if (scan_watch_averages) {
+			scan_start(scan_watch_averages, 0);
+		} else {
+			scan_start_glide();
+		}
+	}
+}
+
+///Answer a sweep from the last one, if the rover has not moved since
+/**
+* Sets the scan task running detection again over the degrees the last whole sweep
+* stored, a degree a pass, and the objects go out as a sweep's would, with n0 as no
+* samples were taken and u 0 as the spreads are not kept.
+* @param averages averages per degree wanted with ping and IR
+* @param fast 1 for an IR only answer
+* @return 1 if answered, 0 if a fresh sweep is needed
+*/
+char scan_from_cache(int averages, char fast)
+{
+	if (averages < 1) {
+		averages = 1;
+	}
+	if (scan_phase != SCAN_IDLE || motion_busy() || scan_cache_epoch != motion_epoch()
+	    || scan_cache_averages < (fast ? 0 : averages)) {
+		return 0;
+	}
+	scan_run_first = -1;
+	scan_last_angle = -1;
+	scan_objects = 0;
+	scan_taken = 0;
+	scan_fast = fast;
+	scan_lo = 0;
+	scan_hi = 179;
+	scan_dir = 1;
+	scan_angle = 0;
+	scan_pass = SCAN_PASS_REPLAY;
+	scan_phase = SCAN_WAIT;
+	return 1;
+}
+
+// Hand the next degree of a continuous sweep to detection
+/**
+* @param ping centimeters to use if no ping fell in the degree
+*/
+static void scan_glide_emit(int ping)
+{
+	struct scan_bin *bin = &scan_bins[scan_angle & (SCAN_GLIDE_BINS - 1)];
+	
+	if (bin->pings) {
+		ping = (bin->ping_sum / bin->pings + 5) / 10;
+	} else if (bin->misses) {
+		ping = SONAR_NO_ECHO;
+	}
+	if (bin->irs) {
+		scan_ir_last = (bin->ir_sum / bin->irs + 5) / 10;
+	}
+	scan_detect(scan_angle, ping, scan_ir_last, 0);
+	memset(bin, 0, sizeof(*bin));
+	scan_angle += scan_dir;
+}
+
+// Bin for a sample taken at tenths of a degree, 0 if that degree has been handed on
+static struct scan_bin *scan_glide_bin(int tenths)
+{
+	int degree = (tenths + 5) / 10;
+	
+	if (degree < scan_lo) {
+		degree = scan_lo;
+	} else if (degree > scan_hi) {
+		degree = scan_hi;
+	}
+	if ((degree - scan_angle) * scan_dir < 0) {
+		return 0;
+	}
+	//Samples should never run that far ahead, but the ring must not wrap; with the link
+	//behind, the sample is dropped instead
+	while ((degree - scan_angle) * scan_dir >= SCAN_GLIDE_BINS) {
+		if (!scan_out_room(1)) {
+			return 0;
+		}
+		scan_glide_emit(scan_ping_at < 0 ? SONAR_NO_ECHO : scan_ping_last);
+	}
+	return &scan_bins[degree & (SCAN_GLIDE_BINS - 1)];
+}
+
+// A ping of a continuous sweep is in: every degree before its own is complete
+/**
+* @param tenths angle of the ping in tenths of a degree
+* @param mm echo distance, 0 for none
+*/
+static void scan_glide_ping(int tenths, unsigned mm)
+{
+	struct scan_bin *bin = scan_glide_bin(tenths);
+	int ping = mm ? (mm + 5) / 10 : SONAR_NO_ECHO;
+	int near;
+	
+	if (bin) {
+		if (mm) {
+			bin->ping_sum += mm;
+			bin->pings++;
+		} else {
+			bin->misses++;
+		}
+	}
+	//Degrees between this ping and the last take whichever of the two is nearer; those
+	//the output has no room for yet are handed on with a later ping
+	while (scan_in(scan_angle) && (tenths - scan_angle * 10) * scan_dir > 5 && scan_out_room(1)) {
+		near = scan_ping_at >= 0 && abs(scan_angle * 10 - scan_ping_at) < abs(tenths - scan_angle * 10);
+		scan_glide_emit(near ? scan_ping_last : ping);
+	}
+	scan_ping_at = tenths;
+	scan_ping_last = ping;
+}
+
+///Scan task
+void scan_step(void)
+{
+	int spread;
+	uint32_t now;
+	struct scan_bin *bin;
+	
+	scan_drain();
+	if (scan_z_owed && !scan_out[(int)scan_out_fill].sealed) {
+		for (; scan_z_owed; scan_z_owed--) {
+			scan_emit_P(PSTR("z"));
+		}
+		scan_seal();
+	}
+	switch (scan_phase) {
+		case SCAN_WAIT:
+			//The sweep before last is still going out over the link
+			if (scan_out[(int)scan_out_fill].sealed || scan_z_owed) {
+				break;
 			}
-			//Same object
-			else {
-				//Writes the object index to the sensor data
-				sensor_data[j].object = currentObject;
+			if (scan_pass == SCAN_PASS_REPLAY) {
+				scan_phase = SCAN_REPLAY;
+				break;
 			}
-		}
-		else{
-			//Check the previous scan, see if it was the current object
-			if (sensor_data[j-1].object == currentObject){
-				//Set the end angle
-				object_detected[currentObject].end_angle = j-1;
-				//Set the angle size
-				object_detected[currentObject].size = object_detected[currentObject].end_angle - object_detected[currentObject].start_angle;
-				//Calculate the angle/index of the center of the object
-				distance_index = (object_detected[currentObject].start_angle + object_detected[currentObject].end_angle)/2;
-				//Record the distance
-				object_detected[currentObject].distance = (sensor_data[distance_index].ir_reading);
-				if (object_detected[currentObject].size  > 2){
-					//Formate and send the data via serial
-					sprintf(str,"o%id%is%ie%iq",currentObject, object_detected[currentObject].distance, object_detected[currentObject].start_angle, object_detected[currentObject].end_angle);
-					serial_putstr(str);
-					lprintf(str);
+			scan_phase = SCAN_MOVE;
+			//Fall through
+		case SCAN_MOVE:
+			//Move servo by 1 degree towards the far end; scan_settled() picks up once it is there
+			scan_phase = SCAN_SETTLE;
+			servo_move_to(scan_angle, scan_settled);
+			break;
+		case SCAN_SAMPLE:
+			//Ping and IR together; the IR conversion is done long before the echo is back
+			if (!scan_fast) {
+				sonar_start();
+			}
+			ir_start(2);
+			scan_phase = SCAN_PING;
+			break;
+		case SCAN_PING:
+			if ((!scan_fast && sonar_busy()) || !ir_ready()) {
+				break;
+			}
+			if (!scan_fast && sonar_distance() != SONAR_NO_ECHO) {
+				scan_ping_mm[scan_echoes++] = sonar_distance_mm();
+			}
+			scan_ir_mm[scan_sample++] = ir_value_mm();
+			scan_taken++;
+			if (!scan_enough()) {
+				scan_phase = SCAN_SAMPLE;
+				break;
+			}
+			//Pings that got no echo are left out; the spread is the larger of the two
+			scan_ping = scan_combine(scan_ping_mm, scan_echoes, &scan_spread);
+			scan_ir = scan_combine(scan_ir_mm, scan_sample, &spread);
+			if (spread > scan_spread) {
+				scan_spread = spread;
+			}
+			//The median stands for the degree when the next one starts
+			scan_prev_angle = scan_angle;
+			scan_prev_ping = scan_echoes ? scan_ping_mm[scan_echoes / 2] : 0;
+			scan_prev_ir = scan_ir_mm[scan_sample / 2];
+			scan_phase = SCAN_NEXT;
+			break;
+		case SCAN_NEXT:
+			//Pass the angle, ping, and IR distance on to detection, once the link has
+			//made room for what that and the end of the sweep may send
+			if (!scan_out_room(scan_stride + 1)) {
+				break;
+			}
+			scan_store();
+			if (scan_pass == SCAN_PASS_FINE) {
+				scan_coarse_fill(scan_angle + scan_dir, scan_next(scan_angle));
+			}
+			scan_angle = scan_next(scan_angle);
+			if (!scan_in(scan_angle)) {
+				if (scan_pass == SCAN_PASS_COARSE) {
+					//Back over the near sectors at 1 degree with ping and IR
+					scan_pass = SCAN_PASS_FINE;
+					scan_fast = 0;
+					scan_averages = scan_fine_averages;
+					scan_stride = 1;
+					scan_dir = -scan_dir;
+					scan_prev_angle = -1;
+					scan_last_angle = -1;
+					scan_angle = scan_next(scan_dir > 0 ? scan_lo - 1 : scan_hi + 1);
+					scan_coarse_fill(scan_dir > 0 ? scan_lo : scan_hi, scan_angle);
 				}
 			}
-		}
+			if (scan_in(scan_angle)) {
+				scan_phase = SCAN_MOVE;
+			} else {
+				scan_finish();
+			}
+			break;
+		case SCAN_GLIDE:
+			//Place each IR value and each ping at the angle of its middle
+			now = sched_ticks();
+			if (ir_ready()) {
+				bin = scan_glide_bin(servo_angle_at(now - ADC_VALUE_TICKS / 2));
+				if (bin) {
+					bin->ir_sum += ir_value_mm();
+					bin->irs++;
+				}
+				ir_start(2);
+			}
+			if (scan_pinging && !sonar_busy()) {
+				scan_pinging = 0;
+				scan_taken++;
+				scan_glide_ping(servo_angle_at(scan_ping_tick + (now - scan_ping_tick) / 2),
+					sonar_distance() == SONAR_NO_ECHO ? 0 : sonar_distance_mm());
+			}
+			if (scan_pinging) {
+				break;
+			}
+			if (servo_busy()) {
+				scan_ping_tick = sched_ticks();
+				sonar_start();
+				scan_pinging = 1;
+				break;
+			}
+			//The servo is at the far end: the remaining degrees keep the last ping, one a
+			//pass as the link makes room
+			if (!scan_out_room(1)) {
+				break;
+			}
+			if (scan_in(scan_angle)) {
+				scan_glide_emit(scan_ping_at < 0 ? SONAR_NO_ECHO : scan_ping_last);
+			} else {
+				scan_finish();
+			}
+			break;
+		case SCAN_REPLAY:
+			//A degree of the last sweep's store a pass, then its end
+			if (!scan_out_room(1)) {
+				break;
+			}
+			if (scan_in(scan_angle)) {
+				scan_detect(scan_angle, scan_degrees[scan_angle].ping, scan_degrees[scan_angle].ir, 0);
+				scan_angle++;
+			} else {
+				scan_finish();
+			}
+			break;
 	}
+}
 
-	//Send a z character to indicate end of transmission
-	serial_putstr("z");
-	
+///Whether a sweep is in progress
+char scan_busy(void)
+{
+	return scan_phase != SCAN_IDLE;
+}
+
+///Abandon the sweep in progress, if any, ending its transmission with a z
+void scan_stop(void)
+{
+	scan_watching = 0;
+	if (scan_phase != SCAN_IDLE) {
+		scan_phase = SCAN_IDLE;
+		scan_answer_empty();
+	}
+}
+
+///Answer a scan command with a lone z, behind the sweep output still queued
+void scan_answer_empty(void)
+{
+	//With both buffers taken the z goes out once there is one
+	if (scan_out[(int)scan_out_fill].sealed) {
+		scan_z_owed++;
+	} else {
+		scan_emit_P(PSTR("z"));
+		scan_seal();
+	}
+}
+
+// Plays the second slot of the victory tune once the first has finished
+static sched_timer_t song_timer;
+
+static void song_end(void){
+	oi_play_song(SONG_VICTORY_END);
 }
 
 ///Play music
-void playsong(char *notes, char *duration){
-	forward(0);
-	oi_load_song(0,26,notes,duration);
-	oi_play_song(0);
+/**
+* Starts the victory tune; a timer plays its second slot once the first has finished
+* (durations are 1/64 s)
+*/
+void playsong(void){
+	unsigned long length = 0;
+	int i;
+	for (i = 0; i < 16; i++) {
+		length += pgm_read_byte(&victory_duration[i]);
+	}
+	oi_play_song(SONG_VICTORY);
+	sched_timer_start(&song_timer, length * 1000 / 64, song_end);
 }
 
 ///Beep
 void beep(void){
-	oi_t* sensor = oi_alloc();
-	oi_init(sensor);
-	unsigned char beep_note[1] = {70};
-	unsigned char beep_dur[1] = {5};
-	oi_load_song(2,1,beep_note,beep_dur);
-	oi_play_song(2);
-	oi_free(sensor);
+	oi_play_song(SONG_BEEP);
 }
 
 ///Play a sound on error
 void errorsound(void){
-	oi_t* sensor = oi_alloc();
-	oi_init(sensor);
-	unsigned char beep_note[3] = {63,72,81};
-	unsigned char beep_dur[3] = {5,5,5};
-	oi_load_song(3,3,beep_note,beep_dur);
-	oi_play_song(3);
-	oi_free(sensor);
-}
\ No newline at end of file
+	oi_play_song(SONG_ERROR);
+}
+
+#ifndef HAL_HOST
+
+extern uint8_t __heap_start; // first byte past the static data, from the linker
+#define SRAM_PAINT 0xC5
+
+// Fill the SRAM between the static data and the stack before main(), so sram_low() can
+// see how far the stack has ever reached into it
+void sram_paint(void) __attribute__((naked, used, section(".init3")));
+void sram_paint(void)
+{
+	uint8_t *p = &__heap_start;
+	
+	while (p < (uint8_t *)SP) {
+		*p++ = SRAM_PAINT;
+	}
+}
+
+///SRAM free between the static data and the stack right now, in bytes
+unsigned sram_free(void)
+{
+	return (uint8_t *)SP - &__heap_start;
+}
+
+///SRAM the stack has never reached since reset, in bytes
+unsigned sram_low(void)
+{
+	uint8_t *p = &__heap_start;
+	
+	while (p < (uint8_t *)SP && *p == SRAM_PAINT) {
+		p++;
+	}
+	return p - &__heap_start;
+}
+
+#else
+
+// The host build has no SRAM budget to keep
+unsigned sram_free(void)
+{
+	return 0;
+}
+
+unsigned sram_low(void)
+{
+	return 0;
+}
+
+#endif
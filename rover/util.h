@@ -10,33 +10,27 @@
 #include <stdlib.h>
 #include <math.h>
 #include <avr/interrupt.h>
+#include <avr/pgmspace.h>
 #include "open_interface.h"
 #include "lcd.h"
+#include "sched.h"
+
+///Song slots on the Create, loaded by init_all()
+#define SONG_VICTORY 0
+#define SONG_VICTORY_END 1
+#define SONG_BEEP 2
+#define SONG_ERROR 3
+
+///The Create's sensor data, kept up to date by the sensor stream
+extern oi_t create;
 
 /// Blocks for a specified number of milliseconds
 /**
-* Uses a prescaled timer to calculate milliseconds
+* Waits on the system clock (see sched.h), so timer 2 keeps running for everything else
 * @param time_val an integer representing how many milliseconds to wait
 */
 void wait_ms(unsigned int time_val);
 
-/// Start timer2
-/**
-* Initializes timer2, used for the wait_ms function
-* @param unit 0 for slow, 1 for fast
-*/
-void timer2_start(char unit);
-
-/// Stop timer2
-void timer2_stop();
-
-
-/// Interrupt handler
-/**
-* Runs every 1 ms and increments the timer counter
-*/
-ISR (TIMER2_COMP_vect);
-
 //Push Buttons and Shaft Encoder
 
 /// Initialize PORTC to accept push buttons as input
@@ -88,6 +82,19 @@ void  move_stepper_motor_by_step(int num_steps, int direction);
 
 //Sonar
 
+///Reported by sonar_distance() and ping_read() when no echo came back in time
+#define SONAR_NO_ECHO 999
+///Reported by sonar_distance_mm() when no echo came back in time
+#define SONAR_NO_ECHO_MM 9999
+///Range per timer 1 tick (0.5 us) in 1/65536 mm: 0.343 mm/us out and back, 0.08575 mm
+#define SONAR_MM_PER_TICK_Q16 5620
+///How long to wait for the echo; the sensor's longest pulse is 18.5 ms after a 750 us holdoff
+#define SONAR_TIMEOUT_MS 30
+///Shortest trigger pulse in 4 us ticks; the sensor wants 2 us, 5 us typical
+#define SONAR_TRIGGER_TICKS 2
+///Quiet time the sensor needs after an echo before the next trigger, in 4 us ticks (200 us)
+#define SONAR_HOLDOFF_TICKS 50
+
 ///Timer 1 Overflow Counter
 ISR (TIMER1_OVF_vect);
 
@@ -108,53 +115,139 @@ void pulse();
 
 ///Distance Calculator
 /**
-* Calculates distance from time (34,000 cm/seconds = 34 cm/ microsecond, divided by 16 because the prescalar of 1024 causes the timer to increment every 1/15625 of a second
-* We're trying to get microseconds, so divide that 15625 by 1000, so the timer increments every 1/15.6 of a microsecond, which is close to 16, so divide by 16. For some unexplained reason, I had to divide by 2 to get calibration correct.
-* @param time Time in an integer value from the ping sensor (from rising edge to falling edge) - represents timer ticks
-* @return distance in centimeters
+* Sound covers 0.343 mm a microsecond and the echo goes out and back, so each 0.5 us
+* timer tick is 0.08575 mm of range, kept as SONAR_MM_PER_TICK_Q16 / 65536
+* @param time timer ticks from rising edge to falling edge of the echo
+* @return distance in millimeters
+*/
+unsigned distancecalc_mm(uint32_t time);
+
+///Distance Calculator
+/**
+* @param time timer ticks from rising edge to falling edge of the echo
+* @return distance in centimeters, rounded
 */
-unsigned distancecalc(int time);
+unsigned distancecalc(uint32_t time);
 
 ///Send a ping and return distance
 /**
-* Sends a pules, set to low state, wait for done state (handled in the pulse and timer interrupt routines)
-* @return distance in centimeters
+* Runs a measurement through the sonar engine and waits for it to finish
+* @return distance in centimeters, or SONAR_NO_ECHO
 */
 
 unsigned ping_read();
 
+///Start a sonar measurement without waiting for it
+/**
+* Returns at once; sonar_step() raises and ends the trigger, the capture interrupt times the
+* echo and a watchdog gives up on it after SONAR_TIMEOUT_MS. Does nothing while a
+* measurement is running.
+*/
+void sonar_start(void);
+
+///Sonar task
+/**
+* Waits out the quiet time the sensor needs after an echo, holds the trigger up for at
+* least SONAR_TRIGGER_TICKS, then waits for the echo
+*/
+void sonar_step(void);
+
+///Whether the measurement from sonar_start() is still running
+char sonar_busy(void);
+
+///Distance from the last finished measurement
+/**
+* @return distance in centimeters, or SONAR_NO_ECHO if the echo never came
+*/
+unsigned sonar_distance(void);
+
+///Distance from the last finished measurement, in millimeters
+/**
+* @return distance in millimeters, or SONAR_NO_ECHO_MM if the echo never came
+*/
+unsigned sonar_distance_mm(void);
+
 
 
 
 
 //IR Sensor
 
+///Number of ADC channels sampled in the background (see adc_channels in util.c)
+#define ADC_CHANNELS 1
+///Samples summed into each decimated value; 16 gives 2 extra bits
+#define ADC_OVERSAMPLE 16
+///Decimated values kept per channel, a power of two
+#define ADC_RING_SIZE 8
+///Time a decimated value spans, in sched_ticks() (13 ADC clocks of 128 CPU clocks a conversion)
+#define ADC_VALUE_TICKS (ADC_OVERSAMPLE * ADC_CHANNELS * 13 * 128 / 64)
+
 ///Initialize ADC for IR sensor
+/**
+* Starts the background sampler; from here on the ADC interrupt converts the channels in
+* adc_channels in turn
+*/
 void IR_init();
 
-///Linear interpolation
+///Conversion complete
 /**
-* Takes in two points and an x value, returns a y value along that line
-* @param x1 float representing the x value of point one on a line
-* @param x2 float representing the x value of point two on a line
-* @param y1 float representing the y value of point one on a line
-* @param y2 float representing the y value of point two on a line
-* @param x float representing the x value that the desired calculated y value is paired with
-* @return float representing the point on the line that the x input corresponds to
+* Adds the sample to its channel's sum, moves a finished sum into the channel's ring, then
+* starts the next channel
 */
-float line(float x1, float x2, float y1, float y2, float x);
+ISR (ADC_vect);
+
+///Decimated value of a sampled channel
+/**
+* @param channel ADC channel, one of adc_channels
+* @param age 0 for the latest value, up to ADC_RING_SIZE - 1 for older ones
+* @return 12 bit value (the 10 bit reading times 4), 0 for a channel not sampled
+*/
+unsigned adc_recent(char channel, unsigned char age);
+
+///IR distance in mm for each 10 bit ADC value, generated into ir_table.c by tools/ircal
+extern const uint16_t ir_table_mm[1024] PROGMEM;
 
 ///Distance Calculation from ADC's measured value
 /**
-* Takes in the raw distance from the ADC's 10 bit value, does linear interpolation in five regions and returns the distance in centimeters
+* Looks the raw value up in ir_table_mm, generated by tools/ircal from calibration points
 * @param distance_val the raw distance value from the ADC 
 * @return distance in centimeters
 */
 int distance_lookup(int distance_val);
 
+///Distance from an oversampled ADC value
+/**
+* Looks up the 10 bit part and interpolates between neighbouring entries on the 2 extra bits
+* @param value 12 bit value from adc_recent()
+* @return distance in millimeters
+*/
+unsigned ir_lookup_mm(unsigned value);
+
+///Ask for a fresh IR value
+/**
+* The sampler runs all the time; this empties the channel's sum and drops the conversion
+* under way, so that the value ir_ready() waits for is made only of samples taken after
+* the call. A channel the sampler does not cover is ready at once and reads as 0 from the
+* ADC.
+* @param channel channel to use for the ADC
+*/
+void ir_start(char channel);
+
+///Whether a value has been completed since ir_start()
+char ir_ready(void);
+
+///Scaled value of the latest reading on the channel given to ir_start()
+/**
+* @return distance in centimeters
+*/
+unsigned ir_value(void);
+
+///Latest reading on the channel given to ir_start(), in millimeters
+unsigned ir_value_mm(void);
+
 ///Read ADC and return its scaled value
 /**
-* Reads ADC
+* Returns at once with the latest decimated value from the background sampler
 * @param channel channel to use for the ADC
 * @return distance in centimeters
 */
@@ -165,20 +258,70 @@ unsigned ir_read(char channel);
 
 //Servo Control
 
+///Slew time of the servo for 60 degrees, in ms (HS-311 datasheet: 190 ms at 4.8 V)
+#define SERVO_MS_PER_60 190
+///Timer 3 counts per ms (16 MHz, prescaler 8); OCR3A + 1 of them make one 21.5 ms PWM frame
+#define SERVO_COUNTS_PER_MS 2000
+///Time for the horn to come to rest once the slew is done, in ms
+#define SERVO_SETTLE_MS 2
+///Servo position before the first move
+#define SERVO_UNKNOWN 0xFFFF
 
 ///Initialize servo
 void servo_init( void );
 
+///Start the servo towards a degree angle
+/**
+* Sets the pulse width and works out from the slew model how long the move takes: the rest
+* of the PWM frame and the new pulse before the servo sees the command, the angular step
+* at SERVO_MS_PER_60, plus SERVO_SETTLE_MS for the horn to come to rest. A
+* move that starts while another is under way is timed from the farther of that move's
+* ends; the first move after power up is timed as a full sweep.
+* @param degree angle in degrees to set the servo to
+* @param settled called once the servo is there, or 0
+*/
+void servo_move_to(unsigned degree, void (*settled)(void));
+
+///How far the servo trails the command in a sweep, in ms: it picks up the ramp only once a 21.5 ms PWM frame, as each pulse ends, so it follows about a frame behind
+#define SERVO_LAG_MS 22
+
+///Sweep the servo to a degree angle at a steady rate
+/**
+* Steps the command a degree at a time, so the servo moves at the given rate rather than
+* at full slew, and servo_angle_at() can tell where it was at any moment. A servo that is
+* still moving, or not yet placed, is sent straight to the angle instead.
+* @param degree angle in degrees to end at
+* @param ms_per_degree rate of the sweep, no faster than SERVO_MS_PER_60 allows
+* @param settled called once the servo has come to rest at the end, or 0
+*/
+void servo_sweep(unsigned degree, unsigned ms_per_degree, void (*settled)(void));
+
+///Where the servo was at a moment of the sweep under way or last made
+/**
+* The command ramps a degree every ms_per_degree and the servo follows it SERVO_LAG_MS
+* behind. Outside a sweep this is simply the angle last sent.
+* @param ticks time from sched_ticks()
+* @return angle in tenths of a degree
+*/
+int servo_angle_at(uint32_t ticks);
+
+///Whether the servo is still on its way
+char servo_busy(void);
+
+///Angle the servo was last sent to, SERVO_UNKNOWN before the first move
+unsigned servo_position(void);
+
 ///Set servo to degree angle
 /**
-* Moves servo to a degree angle
+* Moves servo to a degree angle and waits for it to settle
 * @param degree angle in degrees to set the servo to
 */
 void move_servo(unsigned degree);
 
 ///Calculate Servo degree value
 /**
-* Takes in a degree value, and returns the PWM value required (Top value of the WGM)
+* Takes in a degree value, and returns the PWM value required (Top value of the WGM):
+* 800 (0.4 ms) at 0 degrees plus 19.7 a degree, in integer math
 * @param degree desired angle value in degrees
 * @return WGM top value
 */
@@ -189,19 +332,62 @@ unsigned servo_degree_calc(unsigned degree);
 
 //Serial
 
+///Size of the USART0 receive ring, a power of two
+#define SERIAL_RX_SIZE 64
+///Size of the USART0 transmit ring, a power of two
+#define SERIAL_TX_SIZE 128
+
+///Received characters lost because the receive ring was full
+extern volatile unsigned int serial_rx_dropped;
+
 ///Initialize USART0 to a given baud rate
 void serial_init(void);
 
+///Receive interrupt, moves the byte into the receive ring
+ISR (USART0_RX_vect);
+
+///Data register empty interrupt, feeds the next byte of the transmit ring
+ISR (USART0_UDRE_vect);
+
+///Queue a character without waiting
+/**
+* @param data character to send
+* @return 1 if queued, 0 if the transmit buffer is full
+*/
+int serial_put(char data);
+
+///Take a received character without waiting
+/**
+* @param data where to store the character
+* @return 1 if a character was taken, 0 if none has arrived
+*/
+int serial_get(char *data);
+
+///Look at the next received character without taking it
+/**
+* @return the character, or -1 if none has arrived
+*/
+int serial_peek(void);
+
+///Number of received characters waiting
+unsigned char serial_available(void);
+
+///Characters serial_put() would still take
+unsigned char serial_room(void);
+
+///Wait until everything queued has been handed to the USART
+void serial_flush(void);
+
 ///Receive a character
 /**
-* Waits for the serial input register is full
-* @return char in serial register
+* Waits until a character is in the receive buffer
+* @return next received char
 */
 char serial_getc();
 
 ///Send a character
 /**
-* Sends a character over the serial port
+* Queues a character for the serial port, waiting only while the transmit buffer is full
 * @param data character to write to serial port
 */
 void serial_putc(char data);
@@ -213,10 +399,61 @@ void serial_putc(char data);
 */
 void serial_putstr(char data[]);
 
+///Send a string from program memory, e.g. serial_putstr_P(PSTR("z"))
+void serial_putstr_P(PGM_P data);
+
+///Serial throughput test
+/**
+* Queues count bytes of a repeating 'A' to 'Y' pattern followed by a 'z', as fast as the
+* transmit buffer takes them. Time the gap between the command and the 'z' on the pilot
+* side to get the effective bytes/s at the current UBRR setting.
+* @param count number of pattern bytes to send
+*/
+void serial_throughput(unsigned count);
+
 
 
 //Movement
 
+///Result of a move cut short by motion_stop() or a new move
+#define MOTION_STOPPED 11
+///Result of a move stopped because the sensor stream went quiet
+#define MOTION_NO_SENSORS 12
+///How long a move goes on without a sensor frame, in ms (frames come every 15 ms)
+#define MOTION_WATCHDOG_MS 100
+
+///Start a move
+/**
+* Sets the wheels going; motion_step() checks the sensors and stops when done. A move
+* still in progress is stopped first, with MOTION_STOPPED as its result.
+* @param kind 'f' forward, 'b' backward (ignores alerts), 'r' clockwise, 'l' counterclockwise
+* @param amount distance in millimeters, or degrees for a rotation
+*/
+void motion_start(char kind, int amount);
+
+///Motion task
+/**
+* Checks the sensors each time the Create streams a new frame (every 15 ms) and stops the
+* move once it has gone far enough or, going forward, something is in the way
+*/
+void motion_step(void);
+
+///Whether a move is in progress
+char motion_busy(void);
+
+///Result of the last move: 0, an error code from forward(), MOTION_STOPPED or MOTION_NO_SENSORS
+int motion_result(void);
+
+///Odometry epoch
+/**
+* Changes whenever a move starts or ends, so anything sensed with the same epoch before
+* and after was sensed from the same spot
+*/
+unsigned motion_epoch(void);
+
+///Stop the move in progress, if any
+void motion_stop(void);
+
 ///Moves forward by distance cm, 1 is forward. -1 is backwards
 /**
 * Sets wheels forward, constantly checks sensor data for errors
@@ -254,32 +491,173 @@ void dodonuts();
 void init_all();
 
 
-///Scan/Sonar function
+//Scan
+
+///Start a sweep
 /**
-* Loops 0 to 180, setting the servo to that degree setting
-* then takes ave_num number of scans, on both ping and IR
-* Averages those reads, and writes them to the sensor_reading struct
-* After reading is done, munch through the sensor_reading, and detect objects
-* After objects have been detected from raw sensor data, format and send over serial
-* @param ave_size number of averages to take per degree
+* scan_step() loops over the 180 degrees, taking averages ping and IR readings at each
+* (IR only for a fast scan) once the servo has settled. Each object is sent over serial
+* as soon as the sweep has passed its far edge; after the last come n and the number of
+* samples taken, and a z. The sweep
+* starts from the end the servo is nearer, so back to back scans go 0 to 179 and 179 to
+* 0 in turn without rewinding. Objects go out, and are numbered, in the order the sweep
+* meets them, so from 179 down on a sweep from 179; within a record s, e, x and y are
+* lower angle first either way.
+* @param averages number of averages to take per degree
+* @param fast 1 for the IR only scan
 */
-void scan(int ave_size);
+void scan_start(int averages, char fast);
 
-///Scan/Sonar function
+///Most samples taken at a degree
+#define SCAN_MAX_SAMPLES 9
+
+///Per degree filters for scan_set_filter()
+#define SCAN_FILTER_MEAN 0		// average of all samples
+#define SCAN_FILTER_MEDIAN 1		// middle sample
+#define SCAN_FILTER_TRIMMED 2		// average without the lowest and highest quarter
+#define SCAN_FILTER_HAMPEL 3		// average without the samples over 3 standard deviations from the median
+
+///Choose how the samples of a degree are combined
+/**
+* Ping and IR samples are kept apart and each combined in integer millimeters; whatever
+* the filter, the degree's spread is the larger of the two median absolute deviations
+* and an object reports the largest spread of its degrees
+* @param filter SCAN_FILTER_MEAN, SCAN_FILTER_MEDIAN, SCAN_FILTER_TRIMMED or SCAN_FILTER_HAMPEL
+* @return 1 if the filter was set, 0 if there is no such filter
+*/
+char scan_set_filter(unsigned filter);
+
+///Standard deviation in mm under which a sequential sweep takes no more samples of a degree
+#define SCAN_AGREE_MM 15
+
+///Start a sweep that samples each degree only until the samples agree
+/**
+* As scan_start() with ping and IR, but a degree is done as soon as its samples are
+* within SCAN_AGREE_MM standard deviation, or after cap samples. A first sample within
+* SCAN_AGREE_MM of the degree before, on both sensors, is taken on its own, so a clean
+* sweep goes at nearly one sample a degree and the extra samples go to the edges and the
+* noisy degrees.
+* @param cap most samples to take per degree
+*/
+void scan_start_sequential(int cap);
+
+///IR standard deviation at SCAN_IR_SIGMA_REF_MM, in mm; it grows with the square of the distance
+#define SCAN_IR_SIGMA_MM 5
+#define SCAN_IR_SIGMA_REF_MM 300
+///Sonar standard deviation in mm, plus 1% of the distance
+#define SCAN_PING_SIGMA_MM 10
+///Largest fused standard deviation, in cm, of a degree taken as part of an object
+#define SCAN_TRUST_CM 10
+
+///Change in distance between neighbouring degrees, in cm, that splits an object in two
+#define SCAN_JUMP_CM 10
+
+///Rate of a continuous sweep, in ms per degree
+#define SCAN_GLIDE_MS_PER_DEG 4
+///Degrees a continuous sweep keeps open for samples still to come, a power of two
+#define SCAN_GLIDE_BINS 16
+///Bytes of object records each of a sweep's two output buffers holds; the sweep waits
+///for the link when the next step could send more than is left, at most three records
+///and the trailer for a step of SCAN_MAX_STEP degrees
+#define SCAN_OUT_SIZE 144
+
+///Start a continuous sweep
+/**
+* The servo sweeps the 180 degrees without stopping at SCAN_GLIDE_MS_PER_DEG while the
+* sonar pings back to back and every IR value is used. Each sample is placed at the angle
+* servo_angle_at() gives for its middle, and the samples of a degree are averaged; a
+* degree no ping fell in takes the nearest ping. Objects stream out as for scan_start(),
+* and n counts the pings.
+*/
+void scan_start_glide(void);
+
+///Sweep over and over until scan_stop()
+/**
+* Each sweep is answered as scan_start() or scan_start_glide() would, ending in n and a
+* z; the next sets off as soon as one ends, from the end the servo is at. The records go
+* out of one of two buffers while the sweep after fills the other, so the link only holds
+* the servo up when it is two sweeps behind or a sweep's records outrun it. The scan task
+* never waits on the link itself; it tries again on its next pass.
+* @param averages number of averages per degree with ping and IR, 0 for continuous sweeps
+*/
+void scan_start_watch(int averages);
+
+///Answer a sweep from the last one, if the rover has not moved since
+/**
+* Each sweep keeps what it saw at every degree. If the last one covered the 180 degrees
+* and ran to its end with the wheels still, with at least the averages asked for, the
+* same filter and the same motion_epoch(), and no move is running now, the scan task
+* runs detection again over what it kept and answers as the sweep would have, with n0,
+* without moving the servo.
+* @param averages averages per degree wanted with ping and IR
+* @param fast 1 for an IR only answer, which any such sweep can give
+* @return 1 if answered, 0 if a fresh sweep is needed
+*/
+char scan_from_cache(int averages, char fast);
+
+///Widest step of a sector sweep, in degrees
+#define SCAN_MAX_STEP 9
+
+///Start a sweep over a sector
+/**
+* As scan_start() with ping and IR, over start to end degrees only, a reading every step
+* degrees standing for the degrees up to the next one. An object running past either end
+* is reported up to that end.
+* @param start first angle of the sector, 0 to 179
+* @param end last angle of the sector, start to 179
+* @param step degrees between readings, 1 to SCAN_MAX_STEP
+* @param averages number of averages to take per reading
+* @return 1 if the sweep started, 0 if the sector was out of range
+*/
+char scan_start_sector(int start, int end, int step, int averages);
+
+///Degrees between the readings of the coarse pass; no wider than the narrowest object reported
+#define SCAN_COARSE_STEP 4
+///IR distance in cm under which the coarse pass asks for a fine look
+#define SCAN_COARSE_RANGE 150
+
+///Start a coarse to fine sweep
 /**
-* Loops 0 to 180, setting the servo to that degree setting
-* then takes one scan on just the IR and writes it to the sensor_reading struct
-* After reading is done, munch through the sensor_reading, and detect objects
-* After objects have been detected from raw sensor data, format and send over serial
+* A fast IR only pass every SCAN_COARSE_STEP degrees, then a pass back over just the
+* degrees within a step of a coarse reading under SCAN_COARSE_RANGE, with ping and IR
+* at the given averages. Detection runs along the fine pass, which hands it the degrees
+* it skips with their coarse IR reading and no echo.
+* @param averages number of averages to take per degree in the fine pass
 */
-void scanfast();
+void scan_start_adaptive(int averages);
+
+///Scan task
+void scan_step(void);
+
+///Whether a sweep is in progress
+char scan_busy(void);
+
+///Abandon the sweep in progress, if any, ending its transmission with a z
+void scan_stop(void);
+
+///Answer a scan command with a lone z, behind the sweep output still queued
+void scan_answer_empty(void);
 
 ///Play music
-void playsong(char *notes, char *duration);
+/**
+* Starts the victory tune; a timer plays its second slot once the first has finished
+* (durations are 1/64 s)
+*/
+void playsong(void);
 
 
 ///Beep
 void beep(void);
 
 ///Play a sound on error
-void errorsound(void);
\ No newline at end of file
+void errorsound(void);
+
+///SRAM free between the static data and the stack, in bytes (0 on the host)
+unsigned sram_free(void);
+
+///SRAM the stack has never touched since reset, in bytes (0 on the host)
+/**
+* The gap is painted before main() and checked byte by byte from the bottom up, so this
+* is the low water mark of sram_free()
+*/
+unsigned sram_low(void);